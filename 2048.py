@@ -9,6 +9,10 @@ import tkinter.messagebox as messagebox
 import sys
 import subprocess
 import math
+import json
+
+# With 5 bit squares ('python3 2048.py --tile-bits 5') the engine holds tiles past 32768, so it can make 65536 itself
+TILE_BITS = int(sys.argv[sys.argv.index('--tile-bits') + 1]) if '--tile-bits' in sys.argv else 4
 
 def to_c_board(pyboard):
     board = 0
@@ -18,7 +22,7 @@ def to_c_board(pyboard):
             if (c == 0):
                 i+=1
                 continue
-            board |= ((int(math.log(c, 2))) << (4*i))
+            board |= ((int(math.log(c, 2))) << (TILE_BITS*i))
             i += 1
     return board
 
@@ -112,6 +116,7 @@ class Game:
         self.won = False
         self.keep_playing = False
         self.uses_ai = uses_ai
+        self.engine = None
 
     def is_game_terminated(self):
         return self.over or (self.won and (not self.keep_playing))
@@ -130,15 +135,39 @@ class Game:
         for i in range(self.start_cells_num):
             self.grid.random_cell()
         
+    def start_engine(self):
+        # One long lived engine process serves every move of the game, so its tables are only built once.
+        # It ponders the possible next boards while this side spawns a tile and repaints.
+        args = ['./2048', '--server', '--ponder', '--tile-bits', str(TILE_BITS)]
+        self.engine = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def stop_engine(self):
+        if self.engine is not None:
+            self.engine.stdin.close()
+            self.engine.wait()
+            self.engine = None
+
+    def request_move(self, board):
+        # The engine answers each board with a single JSON line: the move, per-direction scores, nodes searched and depth
+        self.engine.stdin.write('{}\n'.format(board).encode('utf-8'))
+        self.engine.stdin.flush()
+        line = self.engine.stdout.readline()
+        if not line:
+            raise RuntimeError('the engine exited')
+        response = json.loads(line)
+        # A line the engine couldn't read as a board is answered with an error rather than a move
+        if 'error' in response:
+            raise RuntimeError('the engine rejected board {}: {}'.format(board, response['error']))
+        return response
+
     def ai_handler(self):
+        self.start_engine()
         while True:
             self.grid.clear_flags()
-            cmd = subprocess.Popen(['./2048'], stdin=subprocess.PIPE)
-            cmd.stdin.write('{}\n'.format(to_c_board(self.grid.cells)).encode('utf-8'))
-            cmd.stdin.flush()
-            cmd.stdin.close()
-            cmd.wait()
-            result = cmd.returncode
+            response = self.request_move(to_c_board(self.grid.cells))
+            result = response['move']
+            print('Scores: {}, nodes searched: {}, depth: {}, pondered: {}'.format(response['scores'], response['nodes'],
+                                                                                  response['depth'], response['pondered']))
             if (result == -1):
                 print("GAME OVER")
                 self.panel.root.update() 
@@ -163,6 +192,7 @@ class Game:
             if self.grid.found_2048():
                 self.you_win()
                 if not self.keep_playing:
+                    self.stop_engine()
                     return
 
             self.grid.print_grid()
@@ -176,6 +206,7 @@ class Game:
                 self.game_over()
 
             self.panel.root.update()  
+        self.stop_engine()
         # Show the final losing board correctly
         self.panel.root.update()  
 
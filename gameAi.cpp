@@ -2,26 +2,295 @@
 
 // Stop caching after depth reaches this limit (hits too improbable for this to be more efficient)
 #define CACHE_DEPTH_LIM 15
-// Dont calculate moves where the cumulative probability of the random squares occurring is below this threshold
+// Dont calculate moves where the cumulative probability of the random squares occurring is below this threshold.
+// This is the default, --cprob-threshold sets another.
 #define CPROB_THRESHOLD 0.0001f
 
-static row_t row_left_table [TABLE_SIZE];
-static row_t row_right_table[TABLE_SIZE];
-// Since columns are vertical, we need a board_t to store them. There will still only be 2^16 of them.
-static board_t col_up_table[TABLE_SIZE];
-static board_t col_down_table[TABLE_SIZE];
-// Regular score table is kept for the sake of testing and comparison, heur table is primarily used however.
-static float score_table[TABLE_SIZE];
-static float heur_score_table[TABLE_SIZE];
+// The move and scoring lookup tables are generated ahead of time by tableGen.cpp and compiled in as read-only data
+#include "gameTables.h"
+
+// Weights for the n-tuple evaluator, mapped from --weights when the engine is built with it
+static ntuple_network_t ntuple_network;
+// Search every move to this depth instead of the default, which goes deeper as the board gets harder. 0 for the default.
+static int fixed_depth = 0;
+
+// Probability cutoff of the static policy and of budgeted searches
+static float cprob_threshold = CPROB_THRESHOLD;
+// Chooses the depth and cutoff of each move's search
+static static_depth_policy_t static_depth_policy;
+static adaptive_depth_policy_t adaptive_depth_policy;
+static depth_policy_t *depth_policy = &static_depth_policy;
+static const float adaptive_cutoffs[ADAPTIVE_CUTOFFS] = {1e-3f, 3e-4f, 1e-4f, 3e-5f, 1e-5f};
+// Every plan and the nodes it took, as CSV, when --policy-log is given
+static FILE *policy_log = nullptr;
+static std::mutex policy_log_mutex;
+
+// The heuristic row scores, rebuilt in memory by --heur-weights and by each candidate while tuning
+static const float *heur_scores = heur_score_table;
+static std::vector<float> heur_rebuilt_table;
+// The weights heur_scores was built from, which the other board geometries build their tables from
+static heur_weights_t heur_weights = heur_table_weights;
+// Board geometry played by --bench and --server, see board_ops_t
+static int grid_size = ROW_SIZE;
+static int grid_tile_bits = SQUARE_BITS;
 
 #define USING_FRONTEND true
 
+// Number of threads searching the root moves, 0 or 1 searching them one after another on this thread. Each root move
+// only reuses the entries from before the search and its own, so every thread count gives identical results.
+static int search_threads = 0;
+// Reproduce the original search, where no cached entries are reused between root moves or between moves
+static bool tt_fresh = false;
+// Log2 of the number of transposition table buckets
+static int tt_bits = TT_DEFAULT_BITS;
+// Log2 of the number of buckets in each session's table with --listen
+static int session_tt_bits = SESSION_DEFAULT_TT_BITS;
+// Per move budgets. When either is set the search deepens iteratively until the budget runs out,
+// instead of searching to a fixed depth.
+static double search_time_ms = 0;
+static unsigned long search_node_budget = 0;
+
+// The transposition table persists for the life of the process, across root moves and across moves
+static trans_table_t trans_table;
+
+// Format of the statistics written to stderr for every root move searched, one of the STATS_ formats
+static int stats_format = STATS_TEXT;
+// Search the boards that can follow each move while waiting for the next one in server mode
+static bool use_ponder = false;
+// Treat the 8 rotations and reflections of a board as the same chance node
+static bool use_symmetry = true;
+// Chance nodes shallower than this search their children as tasks on the work-stealing pool, deeper ones search
+// serially. 0 only parallelises the root moves. Needs search_threads > 1.
+static int split_depth = 0;
+// Threads searching the root moves, and the tree above split_depth, started when search_threads > 1
+static task_pool_t task_pool;
+// Index of the pool thread running on this thread, -1 outside the pool
+static thread_local int pool_worker = -1;
+// Search with the explicit stack of score_chance_node_iterative rather than by recursion. Same results, but no node
+// splitting and no pondering, so neither --split-depth nor --ponder is accepted with it.
+static bool iterative_search = false;
+// Frames of the iterative search, one stack per thread searching
+template <typename OPS> static thread_local basic_search_stack_t<OPS> search_stack;
+// Record every move played in server mode to this file. Benchmark games each write their own, named after it and the
+// game's seed.
+static const char *trace_path = nullptr;
+// Deep searches of hard boards, looked up before searching when --position-db is given
+static position_db_t position_db;
+
 int main(int argc, char *argv[]) {
-    instantiate_tables();
 #if !USING_FRONTEND
-    play_game();
+    play_game(argc > 2 && strcmp(argv[1], "--trace") == 0 ? argv[2] : nullptr);
 #endif
 #if USING_FRONTEND
+    bool server = false;
+    int bench_games = 0;
+    int bench_boards = 0;
+    int bench_search_boards = 0;
+    bool regress = false;
+    const char *weights_path = NTUPLE_DEFAULT_WEIGHTS;
+    const char *train_path = nullptr;
+    const char *tune_path = nullptr;
+    const char *analysis_boards = nullptr;
+    const char *replay_path = nullptr;
+    const char *replay_out = nullptr;
+    const char *analysis_out = nullptr;
+    const char *position_db_path = nullptr;
+    const char *listen_path = nullptr;
+    const char *db_build_path = nullptr;
+    std::vector<const char *> db_build_traces;
+    int db_positions = POSITION_DB_DEFAULT_POSITIONS;
+    bool analysis_csv = false;
+    int tune_generations = 100;
+    int tune_games = 32;
+    int train_games = 10000;
+    int tuple_size = 4;
+    float alpha = 0.1f;
+    uint64_t bench_seed = 1;
+    int bench_jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0) {
+            server = true;
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_path = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_games = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--analyze") == 0 && i + 2 < argc) {
+            analysis_boards = argv[++i];
+            analysis_out = argv[++i];
+        } else if (strcmp(argv[i], "--analyze-format") == 0 && i + 1 < argc) {
+            analysis_csv = strcmp(argv[++i], "csv") == 0;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--position-db") == 0 && i + 1 < argc) {
+            position_db_path = argv[++i];
+        } else if (strcmp(argv[i], "--build-position-db") == 0 && i + 1 < argc) {
+            // The database to write, then every trace up to the next flag
+            db_build_path = argv[++i];
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                db_build_traces.push_back(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--db-positions") == 0 && i + 1 < argc) {
+            db_positions = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay-out") == 0 && i + 1 < argc) {
+            replay_out = argv[++i];
+        } else if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc) {
+            grid_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tile-bits") == 0 && i + 1 < argc) {
+            grid_tile_bits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-moves") == 0 && i + 1 < argc) {
+            bench_boards = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--bench-search") == 0 && i + 1 < argc) {
+            bench_search_boards = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--regress") == 0) {
+            regress = true;
+        } else if (strcmp(argv[i], "--iterative") == 0) {
+            iterative_search = true;
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            fixed_depth = std::min(ID_MAX_DEPTH, std::max(0, atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--cprob-threshold") == 0 && i + 1 < argc) {
+            cprob_threshold = std::max(0.0, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--target-nodes") == 0 && i + 1 < argc) {
+            adaptive_depth_policy.target_nodes = std::max(1.0, atof(argv[++i]));
+            depth_policy = &adaptive_depth_policy;
+        } else if (strcmp(argv[i], "--policy-log") == 0 && i + 1 < argc) {
+            policy_log = fopen(argv[++i], "w");
+            if (!policy_log) {
+                fprintf(stderr, "Couldn't write %s\n", argv[i]);
+                return 1;
+            }
+            fputs("board,empties,depth_limit,cprob_threshold,predicted_nodes,nodes,move\n", policy_log);
+        } else if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc) {
+            weights_path = argv[++i];
+        } else if (strcmp(argv[i], "--train") == 0 && i + 1 < argc) {
+            train_path = argv[++i];
+        } else if (strcmp(argv[i], "--train-games") == 0 && i + 1 < argc) {
+            train_games = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--tuple-size") == 0 && i + 1 < argc) {
+            tuple_size = atoi(argv[++i]) == 6 ? 6 : 4;
+        } else if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) {
+            alpha = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--heur-weights") == 0 && i + 1 < argc) {
+            heur_weights_t weights;
+            if (!parse_heur_weights(argv[++i], weights)) {
+                fprintf(stderr, "--heur-weights takes %d comma separated numbers, in the order of the SCORE_ settings\n",
+                        HEUR_WEIGHT_COUNT);
+                return 1;
+            }
+            set_heur_weights(weights);
+        } else if (strcmp(argv[i], "--tune") == 0 && i + 1 < argc) {
+            tune_path = argv[++i];
+        } else if (strcmp(argv[i], "--tune-generations") == 0 && i + 1 < argc) {
+            tune_generations = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--tune-games") == 0 && i + 1 < argc) {
+            tune_games = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            bench_seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            bench_jobs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            search_threads = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--tt-bits") == 0 && i + 1 < argc) {
+            tt_bits = std::min(32, std::max(1, atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--session-tt-bits") == 0 && i + 1 < argc) {
+            session_tt_bits = std::min(32, std::max(1, atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--tt-fresh") == 0) {
+            tt_fresh = true;
+        } else if (strcmp(argv[i], "--ponder") == 0) {
+            use_ponder = true;
+        } else if (strcmp(argv[i], "--no-symmetry") == 0) {
+            use_symmetry = false;
+        } else if (strcmp(argv[i], "--time-ms") == 0 && i + 1 < argc) {
+            search_time_ms = std::max(0.0, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) {
+            search_node_budget = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--split-depth") == 0 && i + 1 < argc) {
+            split_depth = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "off") == 0) stats_format = STATS_OFF;
+            else if (strcmp(argv[i], "text") == 0) stats_format = STATS_TEXT;
+            else if (strcmp(argv[i], "json") == 0) stats_format = STATS_JSON;
+            else if (strcmp(argv[i], "csv") == 0) stats_format = STATS_CSV;
+        }
+    }
+    if (!variant_supported(grid_size, grid_tile_bits)) {
+        fprintf(stderr, "Boards of %dx%d with %d bit squares aren't supported, only 3x3, 4x4 and 5x5 with 4 bits and 4x4 "
+                "with 5 bits\n", grid_size, grid_size, grid_tile_bits);
+        return 1;
+    }
+    bool variant = grid_size != ROW_SIZE || grid_tile_bits != SQUARE_BITS;
+    if (variant && ((bench_games == 0 && !server) || bench_boards || bench_search_boards || regress || train_path ||
+                    tune_path || analysis_boards || replay_path || db_build_path || listen_path)) {
+        fprintf(stderr, "Only --bench and --server play boards other than 4x4 with 4 bit squares\n");
+        return 1;
+    }
+    if (variant && (trace_path || position_db_path)) {
+        fprintf(stderr, "Traces and position databases only hold 4x4 boards with 4 bit squares\n");
+        return 1;
+    }
+    // A stopped iterative search is only ever thrown away, never resumed, so these would gain nothing from it
+    if (iterative_search && split_depth > 0) {
+        fprintf(stderr, "--iterative doesn't split nodes across threads, so it can't be combined with --split-depth\n");
+        return 1;
+    }
+    if (iterative_search && use_ponder) {
+        fprintf(stderr, "--iterative can't be combined with --ponder, which doesn't resume a stopped search\n");
+        return 1;
+    }
+    if (stats_format == STATS_CSV) print_stats_header();
+    if (train_path) {
+        run_ntuple_training(train_path, train_games, tuple_size, alpha, bench_seed);
+        return 0;
+    }
+    if (!EVALUATOR::load(weights_path)) return 1;
+    if (bench_boards > 0) {
+        run_move_benchmark(bench_boards, bench_seed);
+        return 0;
+    }
+    // The other geometries search tables of their own
+    if (!variant) trans_table.resize(tt_bits);
+    trans_table.locking = search_threads > 1 && split_depth > 0;
+    if (bench_search_boards > 0) {
+        run_search_benchmark(bench_search_boards, bench_seed);
+        return 0;
+    }
+    // The calling thread helps out while waiting on its tasks, so the pool needs one thread fewer than requested
+    if (search_threads > 1) task_pool.start(search_threads - 1);
+    if (regress) {
+        return run_regression() ? 0 : 1;
+    }
+    if (db_build_path) {
+        return run_position_db_build(db_build_path, db_build_traces, db_positions, bench_jobs) ? 0 : 1;
+    }
+    if (position_db_path && !position_db.map(position_db_path)) {
+        fprintf(stderr, "%s isn't a version %d position database\n", position_db_path, POSITION_DB_VERSION);
+        return 1;
+    }
+    if (bench_games > 0) {
+        run_benchmark(bench_games, bench_seed, bench_jobs);
+        return 0;
+    }
+    if (replay_path) {
+        return run_replay(replay_path, replay_out, bench_jobs) ? 0 : 1;
+    }
+    if (analysis_boards) {
+        return run_analysis(analysis_boards, analysis_out, analysis_csv, bench_jobs) ? 0 : 1;
+    }
+    if (tune_path) {
+        run_heur_tuning(tune_path, tune_generations, tune_games, bench_seed, bench_jobs);
+        return 0;
+    }
+    if (listen_path) {
+        return run_session_server(listen_path, bench_jobs) ? 0 : 1;
+    }
+    // Server mode keeps a single engine process alive for the whole game, so the tables are only built once
+    if (server) {
+        if (variant) run_variant_server(grid_size, grid_tile_bits);
+        else run_server<default_ops_t>(trans_table);
+        return 0;
+    }
     board_t board;
     std::cin >> board;
     printf("RECEIVED BITBOARD: \n");
@@ -32,149 +301,1262 @@ int main(int argc, char *argv[]) {
 #endif
 }
 
-// Heuristic scoring settings - values taken from existing nneonneo 2048 ai
-static const float SCORE_LOST_PENALTY = 200000.0f;
-static const float SCORE_MONOTONICITY_POWER = 4.0f;
-static const float SCORE_MONOTONICITY_WEIGHT = 47.0f;
-static const float SCORE_SUM_POWER = 3.5f;
-static const float SCORE_SUM_WEIGHT = 11.0f;
-static const float SCORE_MERGES_WEIGHT = 700.0f;
-static const float SCORE_EMPTY_WEIGHT = 270.0f;
-
-void instantiate_tables() {
-    for (unsigned row = 0; row < TABLE_SIZE; row++) {
-        // Store each square
-        unsigned square[ROW_SIZE] = {
-            // Each of these squares is &'d with 0xf = 1111 such that only the last 4 bits are possibly positive.
-            // This technique is used often throughout the software to extract rows or squares.
-                (row) & 0xf,
-                (row >>  SQUARE_BITS) & 0xf,
-                (row >>  2*SQUARE_BITS) & 0xf,
-                (row >> 3*SQUARE_BITS) & 0xf,  
-        };
+template <typename OPS>
+static void run_server(basic_trans_table_t<typename OPS::board_type> &table) {
+    // Read one board per line and answer each with a single JSON line on stdout.
+    // Stdout is reserved for these responses, any diagnostics go to stderr.
+    // With pondering, the boards that can follow each move are searched while waiting for the next board.
+    // A line that isn't a board is answered with an error, as --listen does, so the client is never left waiting.
+    basic_ponder_t<OPS> ponder(&table);
+    trace_writer_t trace;
+    if (trace_path && !trace.open(trace_path, 0)) fprintf(stderr, "Couldn't write %s\n", trace_path);
+    // Bits past the last square, e.g. above bit 36 on the 3x3 board, would be searched as if they were on the board
+    const typename OPS::board_type squares =
+        repeat_square<typename OPS::board_type, OPS::squares, OPS::tile_bits>(OPS::max_rank);
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        typename OPS::board_type board;
+        if (!parse_board(line, board) || (board & ~squares)) {
+            fprintf(stderr, "Not a board: %s\n", line.c_str());
+            printf("{\"error\": \"expected a board\"}\n");
+            fflush(stdout);
+            continue;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        move_result_t result;
+        bool pondered = ponder.finish(board, result);
+        if (!pondered) select_move<OPS>(board, result, table, search_time_ms, search_node_budget);
+        // Traces hold 4x4 boards, so main() only takes --trace for them
+        if constexpr (std::is_same<OPS, default_ops_t>::value) {
+            double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            trace.add(board, result, wall_ms);
+        }
+        printf("{\"move\": %d, \"scores\": [%f, %f, %f, %f], \"nodes\": %lu, \"depth\": %d, \"pondered\": %s}\n", result.move,
+                result.scores[0], result.scores[1], result.scores[2], result.scores[3], result.moves_evaled, result.depth,
+                pondered ? "true" : "false");
+        fflush(stdout);
+        if (use_ponder && result.move >= 0) ponder.start(OPS::play_move(result.move, board));
+    }
+    move_result_t unused;
+    ponder.finish(0, unused);
+}
 
-        // Add this row to the score table
-        float score = 0.0f;
-        for (int i = 0; i < ROW_SIZE; ++i) {
-            int tile = square[i];
-            if (tile >= 2) {
-                // The score is the total sum of the tile and all intermediate merged tiles
-                // Noting we store the power of 2 (n) for each square, the formula is 2^(n+1) - 1
-                score += (tile - 1) * (1 << tile);
+template <typename BOARD> static bool parse_board(const std::string &line, BOARD &board) {
+    // A board code in decimal, read by hand as the streams can't read 128 bit integers. Whitespace around it is fine,
+    // anything else, or a number too large for the board type, isn't a board.
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos) return false;
+    size_t last = line.find_last_not_of(" \t\r");
+    board = 0;
+    for (size_t i = first; i <= last; i++) {
+        if (line[i] < '0' || line[i] > '9') return false;
+        unsigned digit = line[i] - '0';
+        if (board > (BOARD(~BOARD(0)) - digit) / 10) return false;
+        board = board * 10 + digit;
+    }
+    return true;
+}
+
+static std::string board_string(board_t board) {
+    return std::to_string(board);
+}
+
+static std::string board_string(unsigned __int128 board) {
+    std::string digits;
+    do {
+        digits.insert(digits.begin(), char('0' + (int)(board % 10)));
+        board /= 10;
+    } while (board);
+    return digits;
+}
+
+static void run_variant_server(int grid, int tile_bits) {
+    // Each supported geometry is its own instantiation of the server and everything it searches with
+    if (grid == 3) run_geometry_server<board_ops_t<3, 4>>();
+    if (grid == 5) run_geometry_server<board_ops_t<5, 4>>();
+    if (tile_bits == 5) run_geometry_server<board_ops_t<4, 5>>();
+}
+
+template <typename OPS>
+static void run_geometry_server() {
+    // The server on another geometry, with a table of its own sized by --tt-bits like the usual one
+    OPS::init(heur_weights);
+    basic_trans_table_t<typename OPS::board_type> table;
+    table.resize(tt_bits);
+    table.locking = search_threads > 1 && split_depth > 0;
+    run_server<OPS>(table);
+}
+
+template <typename OPS>
+void basic_ponder_t<OPS>::start(board_type board) {
+    // Every empty square with a two in it, the likelier spawn, and then every empty square with a four
+    successors.clear();
+    results.clear();
+    plans.clear();
+    searched = 0;
+    int empties = OPS::count_empty_squares(board);
+    for (int square = 1; square <= 2; square++) {
+        for (int i = 0; i < empties; i++) {
+            successors.push_back(OPS::insert_square_at(board, square, i));
+        }
+    }
+    budget.stopped = false;
+    budget.nodes = 0;
+    budget.pondering = true;
+    worker = std::thread(&basic_ponder_t::search, this);
+}
+
+template <typename OPS>
+void basic_ponder_t<OPS>::search() {
+    // The successors are searched to the usual fixed depth whatever the budget flags, since there is no time limit
+    // to deepen against. A budgeted search of the real board deepens from there, see finish(). Completed subtrees are
+    // left in the table either way, so a search of a board the ponder didn't finish picks up from them.
+    table->new_search();
+    for (board_type successor : successors) {
+        move_result_t result;
+        plans.push_back(depth_policy->plan(board_features<OPS>(successor)));
+        if (!search_root_moves<OPS>(*table, successor, plans.back(), &budget, result, nullptr)) break;
+        results.push_back(result);
+        searched++;
+    }
+}
+
+template <typename OPS>
+bool basic_ponder_t<OPS>::finish(board_type board, move_result_t &result) {
+    // Stop the ponder and take its result for this board, if it finished one. A budgeted search deepens from the
+    // ponder's result instead, so the whole budget goes to the levels below it. That holds as long as the ponder
+    // searched with the cutoff the iterations use, otherwise it only warmed the table.
+    if (!worker.joinable()) return false;
+    budget.stopped = true;
+    worker.join();
+    bool budgeted = search_time_ms > 0 || search_node_budget > 0;
+    for (int i = 0; i < searched; i++) {
+        if (successors[i] == board && budgeted) {
+            if (plans[i].cprob_threshold != cprob_threshold) return false;
+            // No new_search(), so the subtrees the ponder completed stay current and aren't the first to be replaced
+            select_move_budgeted<OPS>(board, result, *table, search_time_ms, search_node_budget, &results[i]);
+            return true;
+        }
+        if (successors[i] == board) {
+            result = results[i];
+            // Only the successor that is played is a measurement. The others are the easy ones the ponder got
+            // through before the board arrived, which would teach the depth policy that boards are cheaper than they are.
+            depth_policy->observe(board_features<OPS>(board), plans[i], result.moves_evaled);
+            // The policy log has a line for every move played, the ones answered by the ponder included
+            if (policy_log) log_search_plan<OPS>(board, plans[i], result);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Set by SIGINT or SIGTERM to shut the multi-session server down cleanly
+static volatile sig_atomic_t session_server_stop = 0;
+
+bool run_session_server(const char *path, int jobs) {
+    // Accept any number of sessions on a Unix socket and answer their boards with a fixed pool of worker threads. This
+    // thread only does the socket I/O: it reads request lines from every session and queues the boards, and the workers
+    // take them in deadline order. A session is only ever searched by one worker at a time, as its moves depend on
+    // each other and its table isn't locked, so no session can hold more than its share of the pool.
+    if (stats_format == STATS_TEXT) stats_format = STATS_OFF;
+    if (search_threads > 0 || split_depth > 0) {
+        fprintf(stderr, "--listen searches every session serially, the pool of --jobs workers is the parallelism\n");
+        search_threads = 0;
+        split_depth = 0;
+        task_pool.stop();
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listen_fd < 0 || strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Couldn't listen on %s\n", path);
+        if (listen_fd >= 0) close(listen_fd);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    // A socket file left behind by an earlier server would make the bind fail
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Couldn't listen on %s\n", path);
+        close(listen_fd);
+        return false;
+    }
+    signal(SIGINT, [](int) { session_server_stop = 1; });
+    signal(SIGTERM, [](int) { session_server_stop = 1; });
+
+    session_server_t server;
+    server.workers = jobs;
+    std::vector<std::thread> pool;
+    for (int i = 0; i < jobs; i++) {
+        pool.emplace_back(&session_server_t::worker_loop, &server);
+    }
+    fprintf(stderr, "Listening on %s with %d workers\n", path, jobs);
+
+    std::vector<char> buffer(4096);
+    while (!session_server_stop) {
+        std::vector<struct pollfd> fds(1);
+        std::vector<session_t *> owners(1, nullptr);
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        {
+            std::unique_lock<std::mutex> guard(server.lock);
+            for (std::unique_ptr<session_t> &session : server.sessions) {
+                if (session->closed) continue;
+                struct pollfd entry = {session->fd, POLLIN, 0};
+                fds.push_back(entry);
+                owners.push_back(session.get());
             }
         }
-        score_table[row] = score;
+        // Wake up now and then to notice a stop signal
+        if (poll(fds.data(), fds.size(), 200) <= 0) continue;
 
-        // Add row to heuristic score table
-        float sum = 0;
-        int empty = 0;
-        int merges = 0;
-
-        int prev = 0;
-        int counter = 0;
-        for (int i = 0; i < ROW_SIZE; ++i) {
-            int rank = square[i];
-            sum += pow(rank, SCORE_SUM_POWER);
-            // Count the amount of empty squares
-            if (rank == 0) {
-                empty++;
-            } else {
-                // Test the amount of merges possible
-                if (prev == rank) {
-                    counter++;
-                } else if (counter > 0) {
-                    merges += 1 + counter;
-                    counter = 0;
-                }
-                prev = rank;
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) {
+                // A client that stops reading its responses mustn't hold up a worker for long
+                struct timeval timeout = {1, 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                std::unique_lock<std::mutex> guard(server.lock);
+                server.sessions.emplace_back(new session_t(server.next_id++, fd));
+            }
+        }
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            session_t *session = owners[i];
+            ssize_t n = read(session->fd, buffer.data(), buffer.size());
+            bool hung_up = n <= 0;
+            if (n > 0) session->input.append(buffer.data(), n);
+            // Every complete line is a request
+            size_t start = 0;
+            size_t end;
+            while ((end = session->input.find('\n', start)) != std::string::npos) {
+                session->input[end] = '\0';
+                server.handle_line(session, session->input.c_str() + start);
+                start = end + 1;
+            }
+            session->input.erase(0, start);
+            if (session->input.size() > SESSION_LINE_LIMIT) hung_up = true;
+            if (hung_up) {
+                std::unique_lock<std::mutex> guard(server.lock);
+                session->closed = true;
+                server.queued -= session->pending.size();
+                session->pending.clear();
+                if (!session->busy) server.remove_session(session);
             }
         }
-        if (counter > 0) {
-            merges += 1 + counter;
+    }
+
+    // Let the workers finish the boards they hold, then report on every session still connected
+    {
+        std::unique_lock<std::mutex> guard(server.lock);
+        server.stopping = true;
+        server.work.notify_all();
+    }
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    fprintf(stderr, "%s\n", server.metrics().c_str());
+    for (std::unique_ptr<session_t> &session : server.sessions) {
+        close(session->fd);
+    }
+    close(listen_fd);
+    unlink(path);
+    return true;
+}
+
+void session_server_t::handle_line(session_t *session, const char *line) {
+    if (strcmp(line, "metrics") == 0) {
+        write_line(session, metrics());
+        return;
+    }
+    if (strncmp(line, "target ", 7) == 0) {
+        std::unique_lock<std::mutex> guard(lock);
+        session->target_ms = std::max(0.0, atof(line + 7));
+        return;
+    }
+    char *end;
+    board_t board = strtoull(line, &end, 10);
+    if (end == line) {
+        write_line(session, "{\"error\": \"expected a board, \\\"target MS\\\" or \\\"metrics\\\"\"}");
+        return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    session->pending.push_back(session_request_t{board, std::chrono::steady_clock::now()});
+    queued++;
+    work.notify_one();
+}
+
+session_t *session_server_t::next_session() {
+    // Earliest deadline first, each request being due its session's target after it arrived. Requests without a
+    // target are ordered as if due a second after arriving, so they neither jump every timed request nor starve.
+    session_t *next = nullptr;
+    std::chrono::steady_clock::time_point next_deadline;
+    for (std::unique_ptr<session_t> &session : sessions) {
+        if (session->busy || session->closed || session->pending.empty()) continue;
+        double slack_ms = session->target_ms > 0 ? session->target_ms : SESSION_UNTIMED_SLACK_MS;
+        std::chrono::steady_clock::time_point deadline =
+                session->pending.front().arrival + std::chrono::microseconds((long long)(slack_ms * 1000));
+        if (!next || deadline < next_deadline) {
+            next = session.get();
+            next_deadline = deadline;
+        }
+    }
+    return next;
+}
+
+void session_server_t::worker_loop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        session_t *session = nullptr;
+        work.wait(guard, [&]() { return stopping || (session = next_session()) != nullptr; });
+        if (stopping) return;
+
+        // Take the session's oldest boards. A client that pipelines boards (e.g. analysing positions rather than
+        // playing) has them answered back to back, on the same warm table.
+        session->busy = true;
+        busy_workers++;
+        std::vector<session_request_t> batch;
+        while (!session->pending.empty() && batch.size() < SESSION_BATCH) {
+            batch.push_back(session->pending.front());
+            session->pending.pop_front();
+        }
+        queued -= batch.size();
+        double target_ms = session->target_ms;
+        guard.unlock();
+
+        // Allocate the table here rather than on accept, so the I/O thread isn't held up and idle sessions cost nothing
+        if (session->table.capacity() == 0) session->table.resize(session_tt_bits);
+
+        std::vector<float> latencies;
+        double waited_ms = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (const session_request_t &request : batch) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            double queued_ms = std::chrono::duration<double, std::milli>(now - request.arrival).count();
+            // The search gets whatever is left of the target once the request has waited its turn
+            double time_ms = target_ms > 0 ? std::max(SESSION_MIN_BUDGET_MS, target_ms - queued_ms) : search_time_ms;
+            move_result_t result;
+            select_move(request.board, result, session->table, time_ms, search_node_budget);
+            double latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                                         request.arrival).count();
+            char line[256];
+            snprintf(line, sizeof(line), "{\"move\": %d, \"scores\": [%f, %f, %f, %f], \"nodes\": %lu, \"depth\": %d, "
+                     "\"latency_ms\": %.3f, \"queued_ms\": %.3f}", result.move, result.scores[0], result.scores[1],
+                     result.scores[2], result.scores[3], result.moves_evaled, result.depth, latency_ms, queued_ms);
+            write_line(session, line);
+            latencies.push_back(latency_ms);
+            waited_ms += queued_ms;
         }
-        
-        // Weight the monotonicity in heur score
-        float monotonicity_left = 0;
-        float monotonicity_right = 0;
-        for (int i = 1; i < ROW_SIZE; ++i) {
-            if (square[i-1] > square[i]) {
-                monotonicity_left += pow(square[i-1], SCORE_MONOTONICITY_POWER) - pow(square[i], SCORE_MONOTONICITY_POWER);
+        double served_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        guard.lock();
+        for (float latency_ms : latencies) {
+            if (session->latencies.size() < SESSION_LATENCY_WINDOW) {
+                session->latencies.push_back(latency_ms);
             } else {
-                monotonicity_right += pow(square[i], SCORE_MONOTONICITY_POWER) - pow(square[i-1], SCORE_MONOTONICITY_POWER);
+                session->latencies[session->latency_next] = latency_ms;
             }
+            session->latency_next = (session->latency_next + 1) % SESSION_LATENCY_WINDOW;
+            if (target_ms > 0 && latency_ms > target_ms) session->missed++;
+        }
+        session->moves += batch.size();
+        session->served_ms += served_ms;
+        session->waited_ms += waited_ms;
+        session->busy = false;
+        busy_workers--;
+        if (session->closed) {
+            remove_session(session);
+        } else if (!session->pending.empty()) {
+            work.notify_one();
         }
+    }
+}
+
+void session_server_t::remove_session(session_t *session) {
+    // Called with the lock held, once no worker holds the session
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i].get() != session) continue;
+        close(session->fd);
+        sessions.erase(sessions.begin() + i);
+        return;
+    }
+}
 
-        heur_score_table[row] = SCORE_LOST_PENALTY +
-            SCORE_EMPTY_WEIGHT * empty +
-            SCORE_MERGES_WEIGHT * merges -
-            SCORE_MONOTONICITY_WEIGHT * std::min(monotonicity_left, monotonicity_right) -
-            SCORE_SUM_WEIGHT * sum;
+std::string session_server_t::metrics() {
+    // One JSON line: the pool and queue, then every connected session's latencies over its recent responses
+    std::unique_lock<std::mutex> guard(lock);
+    char text[512];
+    snprintf(text, sizeof(text), "{\"sessions\": %zu, \"workers\": %d, \"busy_workers\": %d, \"queue_depth\": %zu, "
+             "\"session_stats\": [", sessions.size(), workers, busy_workers, queued);
+    std::string line = text;
+    bool first = true;
+    for (std::unique_ptr<session_t> &session : sessions) {
+        if (session->closed) continue;
+        std::vector<float> sorted = session->latencies;
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double p) {
+            return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+        };
+        snprintf(text, sizeof(text), "%s{\"id\": %d, \"target_ms\": %g, \"queued\": %zu, \"moves\": %lu, \"missed\": %lu, "
+                 "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"mean_queued_ms\": %.3f, "
+                 "\"served_ms\": %.1f}", first ? "" : ", ", session->id, session->target_ms, session->pending.size(),
+                 session->moves, session->missed, percentile(0.5), percentile(0.9), percentile(0.99),
+                 sorted.empty() ? 0.0 : sorted.back(), session->moves ? session->waited_ms / session->moves : 0.0,
+                 session->served_ms);
+        line += text;
+        first = false;
+    }
+    return line + "]}";
+}
+
+static bool write_line(session_t *session, const std::string &line) {
+    // Whole lines only, so responses from a worker and metrics from the I/O thread never interleave
+    std::unique_lock<std::mutex> guard(session->write_lock);
+    std::string data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(session->fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
 
-        // Merge any squares before compressing
-        for (int i = 0; i < ROW_SIZE-1; i++) {
-            if (square[i] == 0) continue;
-            int j = i + 1;
-            while (square[j] == 0) {
-                j++;
+void run_benchmark(int games, uint64_t seed, int jobs) {
+    // Play complete games without any output, spread over a pool of threads, and report on them all at the end.
+    // Game i is seeded with seed + i and starts from an empty table, so a seed set always plays the same games.
+    // Only the human readable lines are dropped, structured statistics are still written if asked for
+    if (stats_format == STATS_TEXT) stats_format = STATS_OFF;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<game_stats_t> results = play_variant_games(grid_size, grid_tile_bits, games, seed, jobs);
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    unsigned long total_moves = 0;
+
+    unsigned long total_nodes = 0;
+    unsigned long total_cachehits = 0;
+    unsigned long total_cacheprobes = 0;
+    std::vector<double> move_ms;
+    std::vector<double> scores;
+    // The five largest tiles the board can hold: 2048 to 32768 on the usual board
+    int top_rank = std::min((1 << grid_tile_bits) - 1, grid_size * grid_size + 1);
+    std::vector<int> reached(top_rank + 1, 0);
+    for (game_stats_t &game : results) {
+        total_moves += game.moves;
+        total_nodes += game.moves_evaled;
+        total_cachehits += game.cachehits;
+        total_cacheprobes += game.cacheprobes;
+        move_ms.insert(move_ms.end(), game.move_ms.begin(), game.move_ms.end());
+        scores.push_back(game.score);
+        reached[game.max_rank]++;
+    }
+    std::sort(move_ms.begin(), move_ms.end());
+    std::sort(scores.begin(), scores.end());
+    auto percentile = [](const std::vector<double> &sorted, double p) {
+        return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    };
+    double mean_score = 0;
+    for (double score : scores) mean_score += score / games;
+
+    printf("games:          %d (seeds %llu-%llu, %d threads)", games, (unsigned long long)seed,
+           (unsigned long long)(seed + games - 1), std::min(jobs, games));
+    if (grid_size != ROW_SIZE || grid_tile_bits != SQUARE_BITS) {
+        printf(" on %dx%d, %d bit squares", grid_size, grid_size, grid_tile_bits);
+    }
+    printf("\n");
+    printf("wall time:      %.2f s\n", wall_s);
+    printf("games/sec:      %.3f\n", games / wall_s);
+    printf("moves/sec:      %.1f\n", total_moves / wall_s);
+    printf("nodes/sec:      %.0f\n", total_nodes / wall_s);
+    printf("cache hit rate: %.2f%% (%lu of %lu probes)\n", total_cacheprobes ? 100.0 * total_cachehits / total_cacheprobes : 0.0,
+           total_cachehits, total_cacheprobes);
+    printf("move latency:   p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", percentile(move_ms, 0.5),
+           percentile(move_ms, 0.9), percentile(move_ms, 0.99), move_ms.empty() ? 0.0 : move_ms.back());
+    printf("score:          min %.0f, p10 %.0f, median %.0f, mean %.0f, p90 %.0f, max %.0f\n", scores.front(),
+           percentile(scores, 0.1), percentile(scores, 0.5), mean_score, percentile(scores, 0.9), scores.back());
+    // A game reaching a tile counts towards every smaller tile too
+    printf("max tile reach:");
+    for (int rank = top_rank - 4; rank <= top_rank; rank++) {
+        int count = 0;
+        for (int r = rank; r <= top_rank; r++) count += reached[r];
+        printf(" %d: %.1f%%%s", 1 << rank, 100.0 * count / games, rank == top_rank ? "\n" : ",");
+    }
+    if (position_db.records) {
+        printf("position db:    %lu of %lu moves (%llu boards)\n", position_db.hits.load(), total_moves + games,
+               (unsigned long long)position_db.header->count);
+    }
+}
+
+template <typename OPS>
+static std::vector<game_stats_t> play_headless_games(int games, uint64_t seed, int jobs) {
+    // Play games seed to seed + games - 1 over a pool of threads. Each game starts from an empty table, so the
+    // results don't depend on how the games are spread over the threads.
+    OPS::init(heur_weights);
+    std::vector<game_stats_t> results(games);
+    std::atomic<int> next_game(0);
+    auto worker = [&]() {
+        // Each thread has its own table, the games don't share search state
+        basic_trans_table_t<typename OPS::board_type> table;
+        table.resize(tt_bits);
+        table.locking = search_threads > 1 && split_depth > 0;
+        for (int game = next_game++; game < games; game = next_game++) {
+            results[game] = play_headless_game<OPS>(seed + game, table);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int i = 1; i < std::min(jobs, games); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    return results;
+}
+
+bool run_analysis(const char *boards_path, const char *out_path, bool csv, int jobs) {
+    // Search every board in a file of raw 64 bit boards, spread over a pool of threads, and write each board's move and
+    // move scores to out_path in the order of the boards file. Each board is searched from an empty table, exactly as a
+    // new engine given that one board would search it, so the results don't depend on the threads or on resuming.
+    // Chunks are only written once every earlier chunk has been, so the output is always a complete prefix of the
+    // results (bar one cut short record) and running again on the same files carries on after it.
+    if (stats_format == STATS_TEXT) stats_format = STATS_OFF;
+    int fd = open(boards_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open %s\n", boards_path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size % sizeof(board_t) != 0) {
+        fprintf(stderr, "%s isn't a file of 64 bit boards\n", boards_path);
+        close(fd);
+        return false;
+    }
+    size_t count = info.st_size / sizeof(board_t);
+    const board_t *boards = nullptr;
+    if (count > 0) {
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Couldn't map %s\n", boards_path);
+            close(fd);
+            return false;
+        }
+        madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+        boards = (const board_t *)mapping;
+    }
+    close(fd);
+
+    size_t done = 0;
+    FILE *out = nullptr;
+    if (resume_analysis(out_path, csv, boards, count, done)) out = fopen(out_path, "ab");
+    if (!out) {
+        fprintf(stderr, "Couldn't write %s, or it holds results for boards other than those in %s\n", out_path, boards_path);
+        if (boards) munmap((void *)boards, info.st_size);
+        return false;
+    }
+    fseeko(out, 0, SEEK_END);
+    if (csv && ftello(out) == 0) fputs(ANALYSIS_CSV_HEADER, out);
+    if (done > 0) printf("Resuming %s after %zu of %zu boards\n", out_path, done, count);
+
+    size_t chunks = (count - done + ANALYSIS_CHUNK - 1) / ANALYSIS_CHUNK;
+    std::vector<std::vector<analysis_record_t>> results(chunks);
+    std::vector<char> ready(chunks, 0);
+    size_t next_chunk = 0;
+    size_t written = 0;
+    bool failed = false;
+    std::mutex mutex;
+    std::condition_variable window_open;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        // Each thread has its own table, as in the benchmark
+        // A scratch table makes each board's search start from what is in effect an empty table, without clearing it
+        trans_table_t table;
+        table.resize(tt_bits);
+        table.locking = search_threads > 1 && split_depth > 0;
+        table.scratch = true;
+        while (true) {
+            size_t chunk;
+            {
+                // Don't run too far ahead of a slow chunk, or the finished chunks behind it pile up in memory
+                std::unique_lock<std::mutex> lock(mutex);
+                window_open.wait(lock, [&]() {
+                    return failed || next_chunk >= chunks || next_chunk < written + ANALYSIS_WINDOW * jobs;
+                });
+                if (failed || next_chunk >= chunks) return;
+                chunk = next_chunk++;
+            }
+            size_t first = done + chunk * ANALYSIS_CHUNK;
+            std::vector<analysis_record_t> records(std::min(count - first, (size_t)ANALYSIS_CHUNK));
+            for (size_t i = 0; i < records.size(); i++) {
+                move_result_t result;
+                select_move(boards[first + i], result, table);
+                records[i].board = boards[first + i];
+                memcpy(records[i].scores, result.scores, sizeof(records[i].scores));
+                records[i].move = result.move;
+                records[i].depth = result.depth;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            results[chunk].swap(records);
+            ready[chunk] = 1;
+            size_t reported = (done + written * ANALYSIS_CHUNK) / ANALYSIS_REPORT_INTERVAL;
+            while (written < chunks && ready[written]) {
+                for (const analysis_record_t &record : results[written]) {
+                    if (csv) {
+                        fprintf(out, "%llu,%d,%f,%f,%f,%f,%d\n", (unsigned long long)record.board, record.move,
+                                record.scores[0], record.scores[1], record.scores[2], record.scores[3], record.depth);
+                    } else {
+                        fwrite(&record, sizeof(record), 1, out);
+                    }
+                }
+                std::vector<analysis_record_t>().swap(results[written]);
+                written++;
+            }
+            if (fflush(out) != 0 && !failed) {
+                fprintf(stderr, "Couldn't write %s\n", out_path);
+                failed = true;
             }
-            if (square[j] == square[i]) {
-                if (square[j] == 0xf) continue; // handle the 32768 limit
-                square[i]++;
-                square[j] = 0;
+            size_t analysed = std::min(count, done + written * ANALYSIS_CHUNK);
+            if (analysed / ANALYSIS_REPORT_INTERVAL > reported) {
+                printf("analysed %zu of %zu boards\n", analysed, count);
+                fflush(stdout);
+            }
+            window_open.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min((size_t)jobs, chunks); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool ok = fclose(out) == 0 && !failed;
+    if (boards) munmap((void *)boards, info.st_size);
+    if (ok) {
+        printf("analysed %zu boards in %.2f s (%.1f boards/sec, %d threads)\n", count - done, wall_s,
+               (count - done) / std::max(wall_s, 1e-9), (int)std::max((size_t)1, std::min((size_t)jobs, chunks)));
+    }
+    return ok;
+}
+
+static bool resume_analysis(const char *out_path, bool csv, const board_t *boards, size_t count, size_t &done) {
+    // Count the results already in the output, and cut off anything after the last complete one
+    int fd = open(out_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    off_t keep = 0;
+    board_t last_board = 0;
+    done = 0;
+    if (csv) {
+        // The lines after the header, each starting with its board
+        std::vector<char> buffer(1 << 20);
+        off_t offset = 0;
+        off_t last_line = 0;
+        size_t lines = 0;
+        ssize_t n;
+        while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                if (buffer[i] != '\n') continue;
+                lines++;
+                last_line = keep;
+                keep = offset + i + 1;
+            }
+            offset += n;
+        }
+        done = lines > 0 ? lines - 1 : 0;
+        char line[32] = {0};
+        if (done > 0 && pread(fd, line, sizeof(line) - 1, last_line) > 0) last_board = strtoull(line, nullptr, 10);
+    } else {
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            return false;
+        }
+        done = info.st_size / sizeof(analysis_record_t);
+        keep = done * sizeof(analysis_record_t);
+        analysis_record_t record;
+        if (done > 0 && pread(fd, &record, sizeof(record), keep - sizeof(record)) == sizeof(record)) last_board = record.board;
+    }
+    // The last result must be for the board at its position, or the output belongs to some other boards file
+    bool ok = done <= count && (done == 0 || last_board == boards[done - 1]) && ftruncate(fd, keep) == 0;
+    close(fd);
+    return ok;
+}
+
+bool trace_writer_t::open(const char *path, uint64_t seed) {
+    file = fopen(path, "wb");
+    if (!file) return false;
+    trace_header_t header = {};
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.seed = seed;
+    header.record_size = sizeof(trace_record_t);
+    fwrite(&header, sizeof(header), 1, file);
+    return fflush(file) == 0;
+}
+
+void trace_writer_t::add(board_t board, const move_result_t &result, double move_ms) {
+    if (!file) return;
+    // The new board is the last one's afterstate plus its spawn, unless a new game has started since
+    if (pending) {
+        int position, rank;
+        bool spawned = find_spawn(afterstate, board, &position, &rank);
+        record.spawn_position = spawned ? position : TRACE_NO_SPAWN;
+        record.spawn_rank = spawned ? rank : 0;
+        fwrite(&record, sizeof(record), 1, file);
+        // Flushed every move, so a trace is complete up to the last move even if the process dies
+        fflush(file);
+    }
+    record = {};
+    record.board = board;
+    memcpy(record.scores, result.scores, sizeof(record.scores));
+    record.move_ms = move_ms;
+    record.move = result.move;
+    record.depth = result.depth;
+    afterstate = result.move >= 0 ? play_move(result.move, board) : board;
+    pending = true;
+}
+
+void trace_writer_t::close() {
+    if (!file) return;
+    if (pending) {
+        record.spawn_position = TRACE_NO_SPAWN;
+        record.spawn_rank = 0;
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    fclose(file);
+    file = nullptr;
+    pending = false;
+}
+
+static bool find_spawn(board_t afterstate, board_t board, int *position, int *rank) {
+    // A spawn changes exactly one square, from empty to a 2 or a 4
+    board_t diff = board ^ afterstate;
+    if (diff == 0) return false;
+    int square = __builtin_ctzll(diff) / SQUARE_BITS;
+    *rank = (board >> (square * SQUARE_BITS)) & SQUARE_MASK;
+    *position = square;
+    return (diff >> (square * SQUARE_BITS)) == (board_t)*rank && (*rank == 1 || *rank == 2);
+}
+
+bool run_replay(const char *trace_path, const char *out_path, int jobs) {
+    // Search every board of a trace again, spread over a pool of threads, and compare the moves and timings with the
+    // recorded ones. Each board is searched from an empty table, as --analyze does. A game played with a persistent
+    // table could have reused deeper entries from earlier moves, so its scores can differ slightly from a replay even
+    // on the same build. --replay-out writes the replayed trace, and replaying that with another build compares two
+    // builds like for like. Returns false if any move diverged.
+    if (stats_format == STATS_TEXT) stats_format = STATS_OFF;
+    int fd = open(trace_path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Couldn't open %s\n", trace_path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    const trace_header_t *header = nullptr;
+    if ((size_t)info.st_size >= sizeof(trace_header_t)) {
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) header = (const trace_header_t *)mapping;
+    }
+    close(fd);
+    if (!header || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+            header->record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s isn't a version %d game trace\n", trace_path, TRACE_VERSION);
+        if (header) munmap((void *)header, info.st_size);
+        return false;
+    }
+    // A record cut short by the recording process dying is left out
+    size_t count = (info.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+    const trace_record_t *recorded = (const trace_record_t *)(header + 1);
+
+    std::vector<trace_record_t> replayed(count);
+    std::atomic<size_t> next_record(0);
+    auto worker = [&]() {
+        // Each board is searched from what is in effect an empty table, see run_analysis
+        trans_table_t table;
+        table.resize(tt_bits);
+        table.locking = search_threads > 1 && split_depth > 0;
+        table.scratch = true;
+        for (size_t i = next_record++; i < count; i = next_record++) {
+            move_result_t result;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            select_move(recorded[i].board, result, table);
+            double move_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            // The spawns belong to the game, so they are kept as recorded
+            replayed[i] = recorded[i];
+            memcpy(replayed[i].scores, result.scores, sizeof(result.scores));
+            replayed[i].move_ms = move_ms;
+            replayed[i].move = result.move;
+            replayed[i].depth = result.depth;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min((size_t)jobs, count); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+
+    size_t move_divergences = 0;
+    size_t score_divergences = 0;
+    double recorded_ms = 0;
+    double replayed_ms = 0;
+    std::vector<double> ratios;
+    for (size_t i = 0; i < count; i++) {
+        const trace_record_t &a = recorded[i];
+        const trace_record_t &b = replayed[i];
+        recorded_ms += a.move_ms;
+        replayed_ms += b.move_ms;
+        if (a.move_ms > 0) ratios.push_back(b.move_ms / a.move_ms);
+        if (a.move != b.move) {
+            if (move_divergences++ < TRACE_REPORT_LIMIT) {
+                printf("move %zu: board %llu, recorded move %d [%f, %f, %f, %f], replayed move %d [%f, %f, %f, %f]\n", i,
+                       (unsigned long long)a.board, a.move, a.scores[0], a.scores[1], a.scores[2], a.scores[3], b.move,
+                       b.scores[0], b.scores[1], b.scores[2], b.scores[3]);
             }
+        } else if (memcmp(a.scores, b.scores, sizeof(a.scores)) != 0) {
+            score_divergences++;
+        }
+    }
+    std::sort(ratios.begin(), ratios.end());
+
+    printf("moves:          %zu (seed %llu)\n", count, (unsigned long long)header->seed);
+    printf("divergences:    %zu moves differ, %zu more with the same move but different scores\n", move_divergences,
+           score_divergences);
+    printf("time:           recorded %.1f ms, replayed %.1f ms (%d threads), median replayed/recorded per move %.3f\n",
+           recorded_ms, replayed_ms, (int)std::max((size_t)1, std::min((size_t)jobs, count)),
+           ratios.empty() ? 0.0 : ratios[ratios.size() / 2]);
+
+    bool ok = true;
+    if (out_path) {
+        FILE *out = fopen(out_path, "wb");
+        ok = out && fwrite(header, sizeof(*header), 1, out) == 1 &&
+             fwrite(replayed.data(), sizeof(trace_record_t), count, out) == count;
+        ok = out && fclose(out) == 0 && ok;
+        if (!ok) fprintf(stderr, "Couldn't write %s\n", out_path);
+    }
+    munmap((void *)header, info.st_size);
+    return ok && move_divergences == 0;
+}
+
+bool position_db_t::map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t prefix = sizeof(position_db_header_t) + POSITION_DB_INDEX_SIZE * sizeof(uint64_t);
+    if ((size_t)info.st_size < prefix) {
+        close(fd);
+        return false;
+    }
+    void *file = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return false;
+    const position_db_header_t *file_header = (const position_db_header_t *)file;
+    if (file_header->magic != POSITION_DB_MAGIC || file_header->version != POSITION_DB_VERSION ||
+            file_header->record_size != sizeof(position_record_t) || file_header->index_bits != POSITION_DB_INDEX_BITS ||
+            (size_t)info.st_size != prefix + file_header->count * sizeof(position_record_t)) {
+        munmap(file, info.st_size);
+        return false;
+    }
+    unmap();
+    mapping = file;
+    size = info.st_size;
+    header = file_header;
+    index = (const uint64_t *)(header + 1);
+    records = (const position_record_t *)(index + POSITION_DB_INDEX_SIZE);
+    // Lookups land all over the file, one page each
+    madvise(mapping, size, MADV_RANDOM);
+    return true;
+}
+
+void position_db_t::unmap() {
+    if (mapping) munmap(mapping, size);
+    mapping = nullptr;
+    size = 0;
+    header = nullptr;
+    index = nullptr;
+    records = nullptr;
+}
+
+const position_record_t *position_db_t::find(board_t canonical) const {
+    // The index narrows the search to the boards sharing the top bits, then a binary search finds the board
+    board_t bucket = canonical >> (BOARD_BITS - POSITION_DB_INDEX_BITS);
+    const position_record_t *first = records + index[bucket];
+    const position_record_t *last = records + index[bucket + 1];
+    const position_record_t *record = std::lower_bound(first, last, canonical,
+            [](const position_record_t &r, board_t b) { return r.board < b; });
+    return record != last && record->board == canonical ? record : nullptr;
+}
+
+bool position_db_t::lookup(board_t board, int depth, move_result_t &result) const {
+    // Only records searched at least as deep as the search that would otherwise be done are used
+    board_t canonical = canonical_board(board);
+    const position_record_t *record = find(canonical);
+    if (!record || record->depth < depth) return false;
+    int symmetry = 0;
+    while (apply_symmetry(board, symmetry) != canonical) symmetry++;
+    // The scores were found for the canonical board, so each move takes the score of its counterpart there
+    result = move_result_t();
+    for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+        int counterpart = symmetric_move(move, symmetry);
+        result.scores[move] = record->scores[counterpart];
+        if (counterpart == record->move) result.move = move;
+    }
+    result.depth = record->depth;
+    hits++;
+    return true;
+}
+
+bool run_position_db_build(const char *out_path, const std::vector<const char *> &trace_paths, int positions, int jobs) {
+    // Deep search the slowest positions of the given traces and add them to the database at out_path, creating it if
+    // need be. A board met in several traces, or as several symmetries, counts once with its slowest time. Boards the
+    // database already holds at the depth they would be searched to are skipped.
+    if (stats_format == STATS_TEXT) stats_format = STATS_OFF;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::pair<board_t, float>> slowest;
+    for (const char *path : trace_paths) {
+        std::vector<trace_record_t> records;
+        if (!read_trace(path, records)) {
+            fprintf(stderr, "%s isn't a version %d game trace\n", path, TRACE_VERSION);
+            return false;
+        }
+        for (const trace_record_t &record : records) {
+            if (record.move >= 0) slowest.push_back(std::make_pair(canonical_board(record.board), record.move_ms));
+        }
+    }
+    size_t traced = slowest.size();
+    std::sort(slowest.begin(), slowest.end(), [](const std::pair<board_t, float> &a, const std::pair<board_t, float> &b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+    slowest.erase(std::unique(slowest.begin(), slowest.end(), [](const std::pair<board_t, float> &a,
+            const std::pair<board_t, float> &b) { return a.first == b.first; }), slowest.end());
+    std::sort(slowest.begin(), slowest.end(), [](const std::pair<board_t, float> &a, const std::pair<board_t, float> &b) {
+        return a.second > b.second;
+    });
+
+    position_db_t existing;
+    std::vector<position_record_t> merged;
+    if (access(out_path, F_OK) == 0) {
+        if (!existing.map(out_path)) {
+            fprintf(stderr, "%s isn't a version %d position database\n", out_path, POSITION_DB_VERSION);
+            return false;
         }
-        // Compress to the left, squares are now in order they would be in after a left shift
-        std::stable_sort(square, square+ROW_SIZE, left_shift_comp);
-        
-        // Concatenate the left-shift sorted squares for the resulting row
-        row_t left_shift_result =  (square[0]) | 
-                                    (square[1] <<  SQUARE_BITS) | 
-                                    (square[2] <<  2*SQUARE_BITS) | 
-                                    (square[3] << 3*SQUARE_BITS);
+        merged.assign(existing.records, existing.records + existing.header->count);
+    }
+    std::vector<board_t> boards;
+    for (size_t i = 0; i < slowest.size() && boards.size() < (size_t)positions; i++) {
+        board_t board = slowest[i].first;
+        const position_record_t *record = existing.records ? existing.find(board) : nullptr;
+        board_features_t features = board_features<default_ops_t>(board);
+        int depth = fixed_depth > 0 ? fixed_depth : default_depth_limit(features) + POSITION_DB_EXTRA_DEPTH;
+        if (!record || record->depth < depth) boards.push_back(board);
+    }
+    existing.unmap();
 
-        // Reverse the order by compressing to the right, to emulate a right shift
-        std::stable_sort(square, square+ROW_SIZE, right_shift_comp);
-        row_t right_shift_result = (square[0]) | 
-                                    (square[1] <<  SQUARE_BITS) | 
-                                    (square[2] <<  2*SQUARE_BITS) | 
-                                    (square[3] << 3*SQUARE_BITS);
+    std::vector<position_record_t> searched(boards.size());
+    std::atomic<size_t> next_board(0);
+    auto worker = [&]() {
+        // Each board is searched from an empty table, as --analyze does, so the records don't depend on the order
+        trans_table_t table;
+        table.resize(tt_bits);
+        table.locking = search_threads > 1 && split_depth > 0;
+        table.scratch = true;
+        for (size_t i = next_board++; i < boards.size(); i = next_board++) {
+            move_result_t result;
+            board_features_t features = board_features<default_ops_t>(boards[i]);
+            int depth = fixed_depth > 0 ? fixed_depth : default_depth_limit(features) + POSITION_DB_EXTRA_DEPTH;
+            table.new_search();
+            search_root_moves<default_ops_t>(table, boards[i], search_plan_t(depth, cprob_threshold), nullptr, result,
+                                             nullptr);
+            position_record_t &record = searched[i];
+            memset(&record, 0, sizeof(record));
+            record.board = boards[i];
+            memcpy(record.scores, result.scores, sizeof(record.scores));
+            record.move = result.move;
+            record.depth = depth;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min((size_t)jobs, boards.size()); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
 
-        // Add this row iteration to the tables
-        row_left_table[row] = left_shift_result;
-        row_right_table[row] = right_shift_result;
+    // A new record replaces an older one for the same board, as it was only searched for being deeper
+    size_t previous = merged.size();
+    merged.insert(merged.end(), searched.begin(), searched.end());
+    std::stable_sort(merged.begin(), merged.end(), [](const position_record_t &a, const position_record_t &b) {
+        return a.board < b.board;
+    });
+    std::vector<position_record_t> records;
+    for (const position_record_t &record : merged) {
+        if (!records.empty() && records.back().board == record.board) records.back() = record;
+        else records.push_back(record);
+    }
+    if (!write_position_db(out_path, records)) {
+        fprintf(stderr, "Couldn't write %s\n", out_path);
+        return false;
+    }
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("traced moves:   %zu from %zu traces, %zu distinct boards\n", traced, trace_paths.size(), slowest.size());
+    printf("searched:       %zu boards in %.2f s (%d threads)\n", boards.size(), wall_s,
+           (int)std::max((size_t)1, std::min((size_t)jobs, boards.size())));
+    printf("database:       %zu boards, %zu before\n", records.size(), previous);
+    return true;
+}
 
-        // Note that while we store this at 'row' in the col tables, these tables will always be referenced after a transpose. 
-        // Hence they will actually be indexed by columns, just in the form of rows, returning the result in the form of a column.
-        col_up_table[row] = transpose_board(left_shift_result); 
-        col_down_table[row] = transpose_board(right_shift_result);
+static bool read_trace(const char *path, std::vector<trace_record_t> &records) {
+    // A record cut short by the recording process dying is left out
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    trace_header_t header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == TRACE_MAGIC &&
+              header.version == TRACE_VERSION && header.record_size == sizeof(trace_record_t);
+    trace_record_t record;
+    while (ok && fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
     }
+    fclose(file);
+    return ok;
 }
 
-// Comparison function for sorting a row to the left
-bool left_shift_comp(const row_t a, const row_t b) {
-    // Should return false if in order. Below is the only out of order case
-    return ((a == 0) && (b != 0));
+static bool write_position_db(const char *path, const std::vector<position_record_t> &records) {
+    // Written to a temporary file and renamed over the old one, so a reader never maps a half written database
+    uint64_t index[POSITION_DB_INDEX_SIZE];
+    size_t record = 0;
+    for (uint64_t bucket = 0; bucket < POSITION_DB_INDEX_SIZE; bucket++) {
+        while (record < records.size() && (records[record].board >> (BOARD_BITS - POSITION_DB_INDEX_BITS)) < bucket) {
+            record++;
+        }
+        index[bucket] = record;
+    }
+    position_db_header_t header = {};
+    header.magic = POSITION_DB_MAGIC;
+    header.version = POSITION_DB_VERSION;
+    header.count = records.size();
+    header.record_size = sizeof(position_record_t);
+    header.index_bits = POSITION_DB_INDEX_BITS;
+
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE *out = fopen(tmp_path.c_str(), "wb");
+    if (!out) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 && fwrite(index, sizeof(index), 1, out) == 1 &&
+              fwrite(records.data(), sizeof(position_record_t), records.size(), out) == records.size();
+    ok = fclose(out) == 0 && ok;
+    return ok && rename(tmp_path.c_str(), path) == 0;
 }
-// Comparison function for sorting a row to the right
-bool right_shift_comp(const row_t a, const row_t b) {
-    // Should return false if in order. Below is the only out of order case
-    return ((a != 0) && (b == 0));
+
+template <typename OPS>
+static game_stats_t play_headless_game(uint64_t seed, basic_trans_table_t<typename OPS::board_type> &table) {
+    rng_t rng(seed);
+    game_stats_t stats;
+    table.clear();
+    trace_writer_t trace;
+    if (trace_path) {
+        std::string path = std::string(trace_path) + "." + std::to_string(seed);
+        if (!trace.open(path.c_str(), seed)) fprintf(stderr, "Couldn't write %s\n", path.c_str());
+    }
+    // Spawned 4s were never merged, so they don't count towards the score. Track them to subtract them at the end.
+    unsigned long score_penalty = 0;
+
+    typename OPS::board_type board = 0;
+    int position, rank;
+    for (int i = 0; i < 2; i++) {
+        board = spawn_square<OPS>(board, rng, &position, &rank);
+        if (rank == 2) score_penalty += 4;
+    }
+    while (true) {
+        std::chrono::steady_clock::time_point move_start = std::chrono::steady_clock::now();
+        move_result_t result;
+        select_move<OPS>(board, result, table, search_time_ms, search_node_budget);
+        std::chrono::steady_clock::time_point move_end = std::chrono::steady_clock::now();
+        stats.move_ms.push_back(std::chrono::duration<double, std::milli>(move_end - move_start).count());
+        // Traces hold 4x4 boards, so main() only takes --trace for them
+        if constexpr (std::is_same<OPS, default_ops_t>::value) trace.add(board, result, stats.move_ms.back());
+        stats.moves_evaled += result.moves_evaled;
+        stats.cachehits += result.cachehits;
+        stats.cacheprobes += result.cacheprobes;
+        if (result.move < 0) break;
+
+        board = OPS::play_move(result.move, board);
+        board = spawn_square<OPS>(board, rng, &position, &rank);
+        if (rank == 2) score_penalty += 4;
+        stats.moves++;
+    }
+    stats.score = OPS::score_game_board(board) - score_penalty;
+    stats.max_rank = OPS::max_tile_rank(board);
+    return stats;
+}
+
+template <typename OPS>
+static typename OPS::board_type spawn_square(typename OPS::board_type board, rng_t &rng, int *position, int *rank) {
+    // A 2 (stored as 1) 90% of the time and a 4 (stored as 2) otherwise, in a uniformly chosen empty square.
+    // The square index and rank of the new tile are passed back, or -1 and 0 if the board is full.
+    *position = -1;
+    *rank = 0;
+    int empties = OPS::count_empty_squares(board);
+    if (board == 0) empties = OPS::squares; // count_empty_squares overflows on an empty board
+    if (empties == 0) return board;
+    int index = rng.below(empties);
+    int new_square = rng.below(10) < 9 ? 1 : 2;
+    typename OPS::board_type new_board = OPS::insert_square_at(board, new_square, index);
+    for (int square = 0; square < OPS::squares; square++) {
+        if (((new_board ^ board) >> (square * OPS::tile_bits)) & OPS::max_rank) *position = square;
+    }
+    *rank = new_square;
+    return new_board;
+}
+
+static unsigned long score_game_board(board_t board) {
+    // The in-game score of a board, assuming every tile was built from merged 2s
+    return (unsigned long)(score_table[(board) & ROW_MASK] +
+                           score_table[(board >> 16) & ROW_MASK] +
+                           score_table[(board >> 32) & ROW_MASK] +
+                           score_table[(board >> 48) & ROW_MASK]);
+}
+
+static int max_tile_rank(board_t board) {
+    int rank = 0;
+    while (board) {
+        rank = std::max(rank, (int)(board & SQUARE_MASK));
+        board >>= SQUARE_BITS;
+    }
+    return rank;
 }
 
 static float score_board(board_t board) {
+    return EVALUATOR::score(board);
+}
+
+static void score_boards(const board_t *boards, int count, float *scores) {
+    EVALUATOR::score_batch(boards, count, scores);
+}
+
+bool heuristic_evaluator_t::load(const char * /* weights_path */) {
+    // The heuristic tables are compiled in, or rebuilt by --heur-weights
+    return true;
+}
+
+static void set_heur_weights(const heur_weights_t &weights) {
+    // Building the table takes a few milliseconds, as the powers are only computed once per rank
+    heur_rebuilt_table.resize(TABLE_SIZE);
+    build_heur_table(weights, heur_rebuilt_table.data());
+    heur_scores = heur_rebuilt_table.data();
+    heur_weights = weights;
+}
+
+static bool parse_heur_weights(const char *text, heur_weights_t &weights) {
+    float values[HEUR_WEIGHT_COUNT];
+    for (int i = 0; i < HEUR_WEIGHT_COUNT; i++) {
+        char *end;
+        values[i] = strtof(text, &end);
+        if (end == text || *end != (i + 1 < HEUR_WEIGHT_COUNT ? ',' : '\0')) return false;
+        text = end + 1;
+    }
+    weights = {values[0], values[1], values[2], values[3], values[4], values[5], values[6]};
+    return true;
+}
+
+inline float heuristic_evaluator_t::score(board_t board) {
     // Since the heuristics involve monotonicity and direction based features, 
     // We need to score the board and the transpose, such that these features are accounted for in each direction.
     return sum_row_scores(board) + sum_row_scores(transpose_board(board));
 }
 
 static float sum_row_scores(board_t board) {
-    return heur_score_table[(board) & ROW_MASK] +
-           heur_score_table[(board >> 16) & ROW_MASK] +
-           heur_score_table[(board >> 32) & ROW_MASK] +
-           heur_score_table[(board >> 48) & ROW_MASK];
+    return heur_scores[(board) & ROW_MASK] +
+           heur_scores[(board >> 16) & ROW_MASK] +
+           heur_scores[(board >> 32) & ROW_MASK] +
+           heur_scores[(board >> 48) & ROW_MASK];
+}
+
+inline void heuristic_evaluator_t::score_batch(const board_t *boards, int count, float *scores) {
+    // Score a batch of leaf boards, four at a time with AVX2 when the build targets it (e.g. -mavx2).
+    // Both paths add the row scores in the same order, so they give bit for bit the same scores as score.
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 4 <= count; i += 4) {
+        score_boards_avx2(boards + i, scores + i);
+    }
+#endif
+    for (; i < count; i++) {
+        scores[i] = score(boards[i]);
+    }
+}
+
+bool ntuple_evaluator_t::load(const char *weights_path) {
+    if (ntuple_network.map(weights_path)) return true;
+    fprintf(stderr, "Couldn't load n-tuple weights from %s, train some with --train %s\n", weights_path, weights_path);
+    return false;
+}
+
+inline float ntuple_evaluator_t::score(board_t board) {
+    // The network estimates the score still to come, so add the score so far. Every leaf shares the root's score,
+    // so this is what separates leaves by the merges made on the way to them.
+    return (float)score_game_board(board) + ntuple_network.value(board);
 }
 
-void play_game() {
+inline void ntuple_evaluator_t::score_batch(const board_t *boards, int count, float *scores) {
+    for (int i = 0; i < count; i++) {
+        scores[i] = score(boards[i]);
+    }
+}
+
+#if defined(__AVX2__)
+static inline __m256i transpose_boards_avx2(__m256i x) {
+    // transpose_board applied to four boards at once, one per 64 bit lane
+    __m256i a1 = _mm256_and_si256(x, _mm256_set1_epi64x(0xF0F00F0FF0F00F0FULL));
+    __m256i a2 = _mm256_and_si256(x, _mm256_set1_epi64x(0x0000F0F00000F0F0ULL));
+    __m256i a3 = _mm256_and_si256(x, _mm256_set1_epi64x(0x0F0F00000F0F0000ULL));
+    __m256i a = _mm256_or_si256(a1, _mm256_or_si256(_mm256_slli_epi64(a2, 12), _mm256_srli_epi64(a3, 12)));
+    __m256i b1 = _mm256_and_si256(a, _mm256_set1_epi64x(0xFF00FF0000FF00FFULL));
+    __m256i b2 = _mm256_and_si256(a, _mm256_set1_epi64x(0x00FF00FF00000000ULL));
+    __m256i b3 = _mm256_and_si256(a, _mm256_set1_epi64x(0x00000000FF00FF00ULL));
+    return _mm256_or_si256(b1, _mm256_or_si256(_mm256_srli_epi64(b2, 24), _mm256_slli_epi64(b3, 24)));
+}
+
+static inline void score_boards_avx2(const board_t *boards, float *scores) {
+    __m256i board = _mm256_loadu_si256((const __m256i *)boards);
+    __m256i transposed = transpose_boards_avx2(board);
+    __m256i row_mask = _mm256_set1_epi64x(ROW_MASK);
+
+    // Gather row k of every board and of every transposed board into one vector, interleaved as
+    // [board 0, transpose 0, board 1, transpose 1, ...], and accumulate the rows in the order sum_row_scores adds them
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k < ROW_SIZE; k++) {
+        __m256i rows = _mm256_and_si256(_mm256_srli_epi64(board, k * ROW_BITS), row_mask);
+        __m256i transposed_rows = _mm256_and_si256(_mm256_srli_epi64(transposed, k * ROW_BITS), row_mask);
+        __m256i indices = _mm256_or_si256(rows, _mm256_slli_epi64(transposed_rows, 32));
+        __m256 row_scores = _mm256_i32gather_ps(heur_scores, indices, sizeof(float));
+        sum = k == 0 ? row_scores : _mm256_add_ps(sum, row_scores);
+    }
+
+    // Each board's score is its own rows plus its transpose's rows, as in score_board
+    float sums[8];
+    _mm256_storeu_ps(sums, sum);
+    for (int i = 0; i < 4; i++) {
+        scores[i] = sums[2 * i] + sums[2 * i + 1];
+    }
+}
+#endif
+
+void play_game(const char *trace_path) {
+    uint64_t seed = time(NULL);
+    srand(seed);
+    trace_writer_t trace;
+    if (trace_path && !trace.open(trace_path, seed)) fprintf(stderr, "Couldn't write %s\n", trace_path);
     board_t board = init_board();
     // We now have our starting board
     while(true) {
@@ -184,7 +1566,10 @@ void play_game() {
         // Given this, there is a way to calculate the score explicitly using just the tiles.
         // However, getting a 4 to begin with means it wasnt a merged tile, and needs to be recorded to subtract from score.
         int score_penalty = 0;
-        int best_move = select_move(board);        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        move_result_t result;
+        int best_move = select_move(board, result);
+        trace.add(board, result, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
 
         if(best_move < 0)
             // get_move_tree_score returns negative if no available moves
@@ -210,40 +1595,435 @@ board_t init_board() {
 
 
 int select_move(board_t board) {
-    // Return the best move for a given board
-    float max_util = 0;
-    int best_move = -1;
+    move_result_t result;
+    return select_move(board, result);
+}
 
-    for (int i = 0; i < MOVE_DIRECTIONS; i++) {
+int select_move(board_t board, move_result_t &result) {
+    return select_move(board, result, trans_table);
+}
+
+int select_move(board_t board, move_result_t &result, trans_table_t &table) {
+    return select_move(board, result, table, search_time_ms, search_node_budget);
+}
 
-        float move_score = score_root_move(board, i);
-        if (move_score > max_util) {
-            best_move = i;
-            max_util = move_score;
+int select_move(board_t board, move_result_t &result, trans_table_t &table, double time_ms, unsigned long node_limit) {
+    return select_move<default_ops_t>(board, result, table, time_ms, node_limit);
+}
+
+template <typename OPS>
+static int select_move(typename OPS::board_type board, move_result_t &result, basic_trans_table_t<typename OPS::board_type> &table,
+                       double time_ms, unsigned long node_limit) {
+    // A budgeted search has no depth planned in advance, so its lookups are gated on the depth the policy would plan
+    board_features_t features = board_features<OPS>(board);
+    search_plan_t plan = depth_policy->plan(features);
+    if constexpr (std::is_same<OPS, default_ops_t>::value) {
+        if (position_db.records && position_db.lookup(board, plan.depth_limit, result)) return result.move;
+    }
+    table.new_search();
+    if (time_ms > 0 || node_limit > 0) return select_move_budgeted<OPS>(board, result, table, time_ms, node_limit);
+
+    search_root_moves<OPS>(table, board, plan, nullptr, result, nullptr);
+    depth_policy->observe(features, plan, result.moves_evaled);
+    if (policy_log) log_search_plan<OPS>(board, plan, result);
+    return result.move;
+}
+
+template <typename OPS>
+static inline board_features_t board_features(typename OPS::board_type board) {
+    return board_features_t{OPS::count_empty_squares(board), OPS::count_distinct_tiles(board)};
+}
+
+static inline int default_depth_limit(const board_features_t &board) {
+    // Boards with more distinct tiles are harder to play, so they are searched deeper
+    if (fixed_depth > 0) return fixed_depth;
+    return std::max(3, board.distinct_tiles - 2);
+}
+
+search_plan_t static_depth_policy_t::plan(const board_features_t &board) {
+    return search_plan_t(default_depth_limit(board), cprob_threshold);
+}
+
+adaptive_depth_policy_t::adaptive_depth_policy_t() : target_nodes(0) {
+    memset(measured, 0, sizeof(measured));
+}
+
+void adaptive_depth_policy_t::estimate(int empties, double *estimates) {
+    // The measured estimate where there is one. A step not yet tried with this many empty squares takes the mean of its
+    // measurements with one more and one fewer, as the empty squares change by about one a move. Failing that it grows
+    // from the step below by the mean growth measured between those steps at any number of empty squares, or by the
+    // prior. The first step starts from 4 moves, 2 spawns in each empty square and 4 moves again.
+    // A guess never expects a deeper or finer search to take fewer nodes, but measurements are taken as they are.
+    for (int step = 0; step < ADAPTIVE_STEPS; step++) {
+        if (measured[empties][step]) {
+            estimates[step] = log_nodes[empties][step];
+            continue;
+        }
+        double estimate = 0;
+        int neighbours = 0;
+        for (int e = std::max(empties - 1, 0); e <= std::min(empties + 1, ADAPTIVE_MAX_EMPTIES); e += 2) {
+            if (!measured[e][step]) continue;
+            estimate += log_nodes[e][step];
+            neighbours++;
+        }
+        if (neighbours > 0) {
+            estimates[step] = estimate / neighbours;
+            continue;
+        }
+
+        if (step == 0) {
+            estimate = log(32.0 * std::max(empties, 1));
+        } else {
+            double growth = 0;
+            int pairs = 0;
+            for (int e = 0; e <= ADAPTIVE_MAX_EMPTIES; e++) {
+                if (!measured[e][step] || !measured[e][step - 1]) continue;
+                growth += log_nodes[e][step] - log_nodes[e][step - 1];
+                pairs++;
+            }
+            estimate = estimates[step - 1] + (pairs > 0 ? std::max(0.0, growth / pairs) : ADAPTIVE_PRIOR_GROWTH / ADAPTIVE_CUTOFFS);
+        }
+        if (step >= ADAPTIVE_CUTOFFS) estimate = std::max(estimate, estimates[step - ADAPTIVE_CUTOFFS]);
+        if (step % ADAPTIVE_CUTOFFS > 0) estimate = std::max(estimate, estimates[step - 1]);
+        estimates[step] = estimate;
+    }
+}
+
+search_plan_t adaptive_depth_policy_t::plan(const board_features_t &board) {
+    // The highest step expected to fit in the target, up to one past the highest measured with about this many empty
+    // squares, or the first step if none is expected to fit
+    int empties = board.empties;
+    double estimates[ADAPTIVE_STEPS];
+    std::lock_guard<std::mutex> guard(mutex);
+    estimate(empties, estimates);
+    int explored = 0;
+    for (int step = 0; step < ADAPTIVE_STEPS; step++) {
+        for (int e = std::max(empties - 1, 0); e <= std::min(empties + 1, ADAPTIVE_MAX_EMPTIES); e++) {
+            if (measured[e][step]) explored = step + 1;
+        }
+    }
+    int chosen = 0;
+    for (int step = 1; step <= std::min(explored, ADAPTIVE_STEPS - 1); step++) {
+        if (estimates[step] <= log(target_nodes)) chosen = step;
+    }
+    search_plan_t plan(1 + chosen / ADAPTIVE_CUTOFFS, adaptive_cutoffs[chosen % ADAPTIVE_CUTOFFS]);
+    plan.predicted_nodes = exp(estimates[chosen]);
+    return plan;
+}
+
+void adaptive_depth_policy_t::observe(const board_features_t &board, const search_plan_t &plan, unsigned long nodes) {
+    int cutoff = std::find(adaptive_cutoffs, adaptive_cutoffs + ADAPTIVE_CUTOFFS, plan.cprob_threshold) - adaptive_cutoffs;
+    if (cutoff == ADAPTIVE_CUTOFFS || plan.depth_limit > ADAPTIVE_MAX_DEPTH) return;
+    int step = (plan.depth_limit - 1) * ADAPTIVE_CUTOFFS + cutoff;
+    int empties = board.empties;
+    double measurement = log(std::max(nodes, 1UL));
+    std::lock_guard<std::mutex> guard(mutex);
+    double &estimate = log_nodes[empties][step];
+    estimate = measured[empties][step] ? estimate + ADAPTIVE_LEARNING_RATE * (measurement - estimate) : measurement;
+    measured[empties][step] = true;
+}
+
+template <typename OPS>
+static void log_search_plan(typename OPS::board_type board, const search_plan_t &plan, const move_result_t &result) {
+    std::lock_guard<std::mutex> guard(policy_log_mutex);
+    fprintf(policy_log, "%s,%d,%d,%g,%.0f,%lu,%d\n", board_string(board).c_str(), OPS::count_empty_squares(board),
+            plan.depth_limit, plan.cprob_threshold, plan.predicted_nodes, result.moves_evaled, result.move);
+    fflush(policy_log);
+}
+
+template <typename OPS>
+static int select_move_budgeted(typename OPS::board_type board, move_result_t &result,
+                                basic_trans_table_t<typename OPS::board_type> &table, double time_ms,
+                                unsigned long node_limit, const move_result_t *searched) {
+    // Search one level deeper each iteration until the time or node budget runs out, and play the move from
+    // the deepest iteration that completed. Earlier iterations leave their chance nodes in the table, which
+    // later iterations reuse wherever enough depth was searched below them. Expectimax has no cutoffs for a move
+    // ordering to tighten, so the root moves are searched in direction order every time. A search of the board already
+    // done elsewhere, i.e. by the ponder, stands in for the iterations up to its depth.
+    // The overlays are sized on a thread's first search. Do that before the clock starts, or the first iteration
+    // looks too slow for a second to fit in the budget.
+    if (split_depth == 0) begin_root_overlays<OPS>(table);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    search_budget_t budget;
+    budget.timed = time_ms > 0;
+    budget.deadline = start + std::chrono::microseconds((long long)(time_ms * 1000));
+    budget.node_limit = node_limit;
+
+    double last_iteration_ms = 0;
+    result = searched ? *searched : move_result_t();
+    // A shallow search of a crowded board can score every legal move 0, so keep deepening for as long as any move is
+    // legal rather than taking the scores to mean there is nothing to search
+    bool legal = false;
+    for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+        legal = legal || OPS::play_move(move, board) != board;
+    }
+    if (!legal) return result.move;
+
+    for (int depth = result.depth + 1; depth <= ID_MAX_DEPTH; depth++) {
+        std::chrono::steady_clock::time_point iteration_start = std::chrono::steady_clock::now();
+        move_result_t iteration;
+        int maxdepth = 0;
+        search_plan_t plan(depth, cprob_threshold);
+        bool completed = search_root_moves<OPS>(table, board, plan, &budget, iteration, &maxdepth);
+        result.moves_evaled += iteration.moves_evaled;
+        result.cachehits += iteration.cachehits;
+        result.cacheprobes += iteration.cacheprobes;
+        if (!completed) break;
+
+        std::copy(iteration.scores, iteration.scores + MOVE_DIRECTIONS, result.scores);
+        result.move = iteration.move;
+        // The depth the search reached, short of the iteration's where the probability cutoff stopped every branch.
+        // Deeper iterations would then search the same tree again.
+        result.depth = maxdepth;
+        if (maxdepth < depth) break;
+
+        if (budget.timed) {
+            // Don't start an iteration that can't finish, assuming it grows by the same factor as the last one did
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            double iteration_ms = std::chrono::duration<double, std::milli>(now - iteration_start).count();
+            double elapsed_ms = std::chrono::duration<double, std::milli>(now - start).count();
+            double growth = last_iteration_ms > 0 ? iteration_ms / last_iteration_ms : 1.0;
+            if (elapsed_ms + iteration_ms * growth > time_ms) break;
+            last_iteration_ms = iteration_ms;
+        }
+    }
+    // The budget is checked from the first iteration on, so a tiny one may not finish even that. A legal move
+    // still beats resigning, so play the first one, with depth 0 to show nothing was searched.
+    for (int move = 0; result.move < 0 && move < MOVE_DIRECTIONS; move++) {
+        if (OPS::play_move(move, board) != board) result.move = move;
+    }
+    return result.move;
+}
+
+template <typename OPS>
+static basic_tt_overlay_t<typename OPS::board_type> *
+begin_root_overlays(const basic_trans_table_t<typename OPS::board_type> &table) {
+    // One overlay per root move for every thread that searches boards, kept for the life of the thread. A lambda
+    // doesn't capture a thread_local, so the tasks are handed this thread's overlays by pointer.
+    static thread_local basic_tt_overlay_t<typename OPS::board_type> overlays[MOVE_DIRECTIONS];
+    for (basic_tt_overlay_t<typename OPS::board_type> &overlay : overlays) {
+        overlay.begin(std::max(1, 64 - table.shift - TT_OVERLAY_BITS_LESS));
+    }
+    return overlays;
+}
+
+template <typename OPS>
+static bool search_root_moves(basic_trans_table_t<typename OPS::board_type> &table, typename OPS::board_type board,
+                              const search_plan_t &plan, search_budget_t *budget, move_result_t &result, int *maxdepth) {
+    // Search every root move, returning false if the budget ran out before all of them finished.
+    // Each root move is searched against the table as it was before the search plus an overlay of its own entries,
+    // which are only added to the table once every root move is done. No root move sees another's entries, so the
+    // scores (and the move) are the same whether the moves are searched one after another or on any number of threads.
+    // Splitting below the root shares entries within a root move too, so there only exact reuse keeps the scores the
+    // same, however many threads search.
+    typedef basic_tt_overlay_t<typename OPS::board_type> overlay_type;
+    search_stats_t stats[MOVE_DIRECTIONS];
+    auto search = [&](int move, overlay_type *overlay) {
+        result.scores[move] = score_root_move<OPS>(table, board, move, plan, budget, &stats[move], overlay);
+    };
+
+    overlay_type *move_overlays = split_depth == 0 ? begin_root_overlays<OPS>(table) : nullptr;
+
+    if (search_threads > 1 && task_pool.running()) {
+        // Root moves are tasks like any other node above the split depth. This thread pops the most recently spawned
+        // task first while others steal the oldest, so spawn in reverse to start them in direction order.
+        task_group_t group;
+        for (int move = MOVE_DIRECTIONS - 1; move >= 0; move--) {
+            task_pool.spawn(group, [&, move]() { search(move, move_overlays ? &move_overlays[move] : nullptr); });
+        }
+        task_pool.wait(group);
+    } else {
+        for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+            search(move, move_overlays ? &move_overlays[move] : nullptr);
+            if (budget && budget->stopped) break;
+        }
+    }
+    // Merge in direction order
+    for (int move = 0; move_overlays && move < MOVE_DIRECTIONS; move++) {
+        move_overlays[move].merge_into(table);
+    }
+
+    // Pick the move in direction order, so ties are broken the same way whatever order threads ran in.
+    // Any legal move beats resigning, even when every one of them scores 0 at this depth (a crowded board searched
+    // shallowly can), so -1 is only returned when no move changes the board.
+    float max_util = 0;
+    result.move = -1;
+    result.depth = plan.depth_limit;
+    for (int i = 0; i < MOVE_DIRECTIONS; i++) {
+        result.moves_evaled += stats[i].moves_evaled;
+        result.cachehits += stats[i].cachehits;
+        result.cacheprobes += stats[i].cacheprobes;
+        if (maxdepth) *maxdepth = std::max(*maxdepth, stats[i].maxdepth);
+        if (OPS::play_move(i, board) == board) continue;
+        if (result.move < 0 || result.scores[i] > max_util) {
+            result.move = i;
+            max_util = result.scores[i];
         }
     }
-    return best_move;
+    return !(budget && budget->stopped);
 }
 
 float score_root_move(board_t board, int move) {
-    if (play_move(move, board) == board) return 0;
-    eval_state state;
-    state.depth_limit = std::max(3, count_distinct_tiles(board) - 2);
-
-    board_t move_board = play_move(move, board);
-    float move_score = score_chance_node(state, move_board, 1.0f);
-    printf("Move %d: result %f: eval'd %ld moves (%d cache hits, %d cache size)) (maxdepth=%d)\n", move, move_score, \
-                state.moves_evaled, state.cachehits, (int)state.cache_table.size(), state.maxdepth);
+    search_plan_t plan = depth_policy->plan(board_features<default_ops_t>(board));
+    return score_root_move<default_ops_t>(trans_table, board, move, plan, nullptr, nullptr, nullptr);
+}
+
+template <typename OPS>
+static float score_root_move(basic_trans_table_t<typename OPS::board_type> &table, typename OPS::board_type board, int move,
+                             const search_plan_t &plan, search_budget_t *budget, search_stats_t *stats,
+                             basic_tt_overlay_t<typename OPS::board_type> *overlay) {
+    if (OPS::play_move(move, board) == board) return 0;
+    basic_eval_state<OPS> state;
+    state.table = &table;
+    state.overlay = overlay;
+    state.exact_cache = split_depth > 0;
+    state.canonical = use_symmetry;
+    // The original search threw its cache away after every root move. The shared table is only written between
+    // searches, and holds none of the current search's entries, so its current entries are already none.
+    if (tt_fresh) state.current_only = true;
+    state.depth_limit = plan.depth_limit;
+    state.cprob_threshold = plan.cprob_threshold;
+    state.budget = budget;
+    state.next_budget_check = BUDGET_CHECK_INTERVAL;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    typename OPS::board_type move_board = OPS::play_move(move, board);
+    float move_score = iterative_search ? score_chance_node_iterative(state, move_board, 1.0f)
+                                        : score_chance_node(state, move_board, 1.0f);
+    if (stats_format != STATS_OFF && !(budget && budget->pondering)) {
+        double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        // Entries are only ever added or overwritten during a search, so the table is at its fullest now
+        log_root_move(state, board, move, move_score, wall_ms, table.filled.load(), table.capacity());
+    }
+    if (stats) {
+        stats->moves_evaled += state.moves_evaled;
+        stats->cachehits += state.cachehits;
+        stats->cacheprobes += state.cacheprobes;
+        stats->maxdepth = std::max(stats->maxdepth, state.maxdepth);
+    }
     return move_score;
 }
 
-static float score_max_node(eval_state &state, board_t board, float cprob) {
+template <typename OPS>
+static void log_root_move(const basic_eval_state<OPS> &state, typename OPS::board_type board, int move, float score,
+                          double wall_ms, size_t filled, size_t capacity) {
+    // Write the line in one go, so lines from root moves searched in parallel don't interleave
+    char line[2048];
+    int len = 0;
+
+    if (stats_format == STATS_TEXT) {
+        len += snprintf(line + len, sizeof(line) - len, "Move %d: result %f: eval'd %lu moves (%lu/%lu cache hits, %zu cache size)) (maxdepth=%d/%d)%s\n",
+                        move, score, state.moves_evaled, state.cachehits, state.cacheprobes, filled,
+                        state.maxdepth, state.depth_limit, state.aborted ? " (out of budget)" : "");
+    } else if (stats_format == STATS_JSON) {
+        len += snprintf(line + len, sizeof(line) - len,
+                        "{\"board\": %s, \"move\": %d, \"score\": %f, \"depth_limit\": %d, \"maxdepth\": %d, \"aborted\": %s, "
+                        "\"wall_ms\": %.3f, \"moves_evaled\": %lu, \"cache_probes\": %lu, \"cache_hits\": %lu, "
+                        "\"table_filled\": %zu, \"table_capacity\": %zu",
+                        board_string(board).c_str(), move, score, state.depth_limit, state.maxdepth, state.aborted ? "true" : "false",
+                        wall_ms, state.moves_evaled, state.cacheprobes, state.cachehits, filled, capacity);
+#if SEARCH_STATS
+        const node_counters_t &c = state.counters;
+        len += snprintf(line + len, sizeof(line) - len,
+                        ", \"max_nodes\": %lu, \"chance_nodes\": %lu, \"leaves\": %lu, \"pruned\": %lu, "
+                        "\"cache_stores\": %lu, \"cache_replaces\": %lu, \"ply_nodes\": [",
+                        c.max_nodes, c.chance_nodes, c.leaves, c.pruned, c.cache_stores, c.cache_replaces);
+        for (int ply = 0; ply <= std::min(state.depth_limit, STATS_MAX_PLY); ply++) {
+            len += snprintf(line + len, sizeof(line) - len, ply ? ", %lu" : "%lu", c.ply_nodes[ply]);
+        }
+        len += snprintf(line + len, sizeof(line) - len, "]");
+#endif
+        len += snprintf(line + len, sizeof(line) - len, "}\n");
+    } else if (stats_format == STATS_CSV) {
+        len += snprintf(line + len, sizeof(line) - len, "%s,%d,%f,%d,%d,%d,%.3f,%lu,%lu,%lu,%zu,%zu",
+                        board_string(board).c_str(), move, score, state.depth_limit, state.maxdepth, state.aborted ? 1 : 0,
+                        wall_ms, state.moves_evaled, state.cacheprobes, state.cachehits, filled, capacity);
+#if SEARCH_STATS
+        // The nodes at each ply share one field, separated by semicolons
+        const node_counters_t &c = state.counters;
+        len += snprintf(line + len, sizeof(line) - len, ",%lu,%lu,%lu,%lu,%lu,%lu,", c.max_nodes, c.chance_nodes,
+                        c.leaves, c.pruned, c.cache_stores, c.cache_replaces);
+        for (int ply = 0; ply <= std::min(state.depth_limit, STATS_MAX_PLY); ply++) {
+            len += snprintf(line + len, sizeof(line) - len, ply ? ";%lu" : "%lu", c.ply_nodes[ply]);
+        }
+#endif
+        len += snprintf(line + len, sizeof(line) - len, "\n");
+    }
+    fputs(line, stderr);
+}
+
+static void print_stats_header() {
+    fputs("board,move,score,depth_limit,maxdepth,aborted,wall_ms,moves_evaled,cache_probes,cache_hits,table_filled,table_capacity"
+#if SEARCH_STATS
+          ",max_nodes,chance_nodes,leaves,pruned,cache_stores,cache_replaces,ply_nodes"
+#endif
+          "\n", stderr);
+}
+
+void node_counters_t::add(const node_counters_t &other) {
+    max_nodes += other.max_nodes;
+    chance_nodes += other.chance_nodes;
+    leaves += other.leaves;
+    pruned += other.pruned;
+    cache_stores += other.cache_stores;
+    cache_replaces += other.cache_replaces;
+    for (int ply = 0; ply <= STATS_MAX_PLY; ply++) {
+        ply_nodes[ply] += other.ply_nodes[ply];
+    }
+}
+
+template <typename OPS>
+static inline bool budget_exhausted(basic_eval_state<OPS> &state) {
+    // Only check the shared budget once every BUDGET_CHECK_INTERVAL nodes, reading the clock is far slower than a node
+    if (state.aborted) return true;
+    if (state.moves_evaled < state.next_budget_check) return false;
+    state.next_budget_check = state.moves_evaled + BUDGET_CHECK_INTERVAL;
+
+    search_budget_t &budget = *state.budget;
+    unsigned long nodes = budget.nodes += state.moves_evaled - state.budget_reported;
+    state.budget_reported = state.moves_evaled;
+    if (budget.stopped ||
+            (budget.node_limit && nodes >= budget.node_limit) ||
+            (budget.timed && std::chrono::steady_clock::now() >= budget.deadline)) {
+        budget.stopped = true;
+        state.aborted = true;
+    }
+    return state.aborted;
+}
+
+template <typename OPS>
+static inline bool probe_cache(basic_eval_state<OPS> &state, typename OPS::board_type board, int depth, float cprob,
+                               float &score) {
+    // The root move's own entries first, then the shared table as it was before the search
+    int reached;
+    if (!(state.overlay && state.overlay->table.probe(board, depth, cprob, false, true, score, reached)) &&
+        !state.table->probe(board, depth, cprob, state.exact_cache, state.current_only, score, reached)) {
+        return false;
+    }
+    // The plies the entry's own search reached count as reached here, up to this search's limit
+    state.maxdepth = std::max(state.maxdepth, std::min(state.curdepth + reached, state.depth_limit));
+    return true;
+}
+
+template <typename OPS>
+static inline int store_cache(basic_eval_state<OPS> &state, typename OPS::board_type board, int depth, float cprob,
+                              float score, int reached) {
+    if (!state.overlay) return state.table->store(board, depth, cprob, score, reached);
+    return state.overlay->store(board, depth, cprob, score, reached);
+}
+
+template <typename OPS>
+static float score_max_node(basic_eval_state<OPS> &state, typename OPS::board_type board, float cprob) {
     // Get the node score for a maximising node by propagating the maximal child node
     float highest_utility = 0.0f;
+    if (state.budget && budget_exhausted(state)) return highest_utility;
     state.curdepth++;
+    SEARCH_STAT(state.counters.max_nodes++; state.counters.ply_nodes[state.curdepth]++);
+    typename OPS::board_type successors[MOVE_DIRECTIONS];
+    OPS::play_all_moves(board, successors);
     for (int move = 0; move < MOVE_DIRECTIONS; ++move) {
         state.moves_evaled++;
-        board_t newboard = play_move(move, board);
+        typename OPS::board_type newboard = successors[move];
 
         if (board != newboard) {
             highest_utility = std::max(highest_utility, score_chance_node(state, newboard, cprob));
@@ -253,84 +2033,567 @@ static float score_max_node(eval_state &state, board_t board, float cprob) {
     return highest_utility;
 }
 
-static float score_chance_node(eval_state &state, board_t board, float cprob) {
+template <typename OPS>
+static void score_frontier_max_nodes(basic_eval_state<OPS> &state, const typename OPS::board_type *boards, int count,
+                                     float *scores) {
+    // Score max nodes whose chance node children are all leaves. This is exactly score_max_node, except that the
+    // successors of every board are generated first and then scored together by the batched leaf kernel.
+    for (int i = 0; i < count; i++) {
+        scores[i] = 0.0f;
+    }
+    if (state.budget && budget_exhausted(state)) return;
+
+    typename OPS::board_type leaves[OPS::squares * MOVE_DIRECTIONS];
+    int owners[OPS::squares * MOVE_DIRECTIONS];
+    int leaf_count = 0;
+    SEARCH_STAT(state.counters.max_nodes += count; state.counters.ply_nodes[state.curdepth + 1] += count);
+    for (int i = 0; i < count; i++) {
+        typename OPS::board_type successors[MOVE_DIRECTIONS];
+        OPS::play_all_moves(boards[i], successors);
+        for (int move = 0; move < MOVE_DIRECTIONS; ++move) {
+            state.moves_evaled++;
+            typename OPS::board_type newboard = successors[move];
+            if (boards[i] != newboard) {
+                leaves[leaf_count] = newboard;
+                owners[leaf_count] = i;
+                leaf_count++;
+            }
+        }
+    }
+
+    float leaf_scores[OPS::squares * MOVE_DIRECTIONS];
+    OPS::score_boards(leaves, leaf_count, leaf_scores);
+    for (int i = 0; i < leaf_count; i++) {
+        scores[owners[i]] = std::max(scores[owners[i]], leaf_scores[i]);
+    }
+    if (leaf_count) state.maxdepth = std::max(state.maxdepth, state.curdepth + 1);
+    SEARCH_STAT(state.counters.leaves += leaf_count; state.counters.ply_nodes[state.curdepth + 1] += leaf_count);
+    // The leaves are a ply below this node's chance node parent, so any short of the limit were cut off by probability
+    SEARCH_STAT(if (state.curdepth + 1 < state.depth_limit) state.counters.pruned += leaf_count);
+}
+
+template <typename OPS>
+static void spawn_max_node(task_group_t &group, basic_eval_state<OPS> &state, basic_eval_state<OPS> &child,
+                           typename OPS::board_type board, float cprob, float *score) {
+    // Search a max node as a task with its own copy of the search state, starting from fresh counters
+    child = state;
+    child.maxdepth = 0;
+    child.cachehits = 0;
+    child.cacheprobes = 0;
+    child.moves_evaled = 0;
+    child.counters = node_counters_t();
+    // Check the budget straight away, as a task may well finish before searching a whole check interval
+    child.next_budget_check = 0;
+    child.budget_reported = 0;
+    task_pool.spawn(group, [&child, board, cprob, score]() {
+        *score = score_max_node(child, board, cprob);
+    });
+}
+
+template <typename OPS>
+static void merge_search_counters(basic_eval_state<OPS> &state, const basic_eval_state<OPS> &child) {
+    state.maxdepth = std::max(state.maxdepth, child.maxdepth);
+    state.cachehits += child.cachehits;
+    state.cacheprobes += child.cacheprobes;
+    state.moves_evaled += child.moves_evaled;
+    state.counters.add(child.counters);
+    // The child reported its nodes to the budget itself, except for those since its last check. Report those now,
+    // and move our own next check along so the child's nodes aren't counted a second time.
+    state.next_budget_check += child.moves_evaled;
+    state.budget_reported += child.moves_evaled;
+    if (state.budget) state.budget->nodes += child.moves_evaled - child.budget_reported;
+    // An incomplete child leaves this node incomplete too, so it mustn't be cached either
+    state.aborted = state.aborted || child.aborted;
+}
+
+template <typename OPS>
+static float score_chance_node(basic_eval_state<OPS> &state, typename OPS::board_type board, float cprob) {
     // Get the node score of a chance node by propagating the expected value of child nodes
-    if (state.curdepth >= state.depth_limit || cprob < CPROB_THRESHOLD) {
+    SEARCH_STAT(state.counters.ply_nodes[state.curdepth]++);
+    if (state.curdepth >= state.depth_limit || cprob < state.cprob_threshold) {
             state.maxdepth = std::max(state.curdepth, state.maxdepth);
-            return score_board(board);
+            SEARCH_STAT(state.counters.leaves++; if (state.curdepth < state.depth_limit) state.counters.pruned++);
+            return OPS::score_board(board);
+        }
+    SEARCH_STAT(state.counters.chance_nodes++);
+
+    // Rotating or reflecting a board doesn't change its value, as moves, spawns and the heuristic are all symmetric.
+    // Searching every chance node in one canonical orientation lets all 8 symmetric boards share a cache entry.
+    if (state.canonical && state.curdepth < CACHE_DEPTH_LIM) {
+        board = OPS::canonical(board);
+    }
+
+    // Take the expected score from the cache if possible.
+    // Depths are stored as the depth remaining below the node, so entries stay comparable between searches.
+    float node_cprob = cprob;
+    int remaining = state.depth_limit - state.curdepth;
+    if (state.curdepth < CACHE_DEPTH_LIM) {
+        float score;
+        state.cacheprobes++;
+        if (probe_cache(state, board, remaining, node_cprob, score)) {
+            state.cachehits++;
+            return score;
+        }
+    }
+
+    // Count the plies reached below this node on their own, so its cache entry can record them
+    int outer_maxdepth = state.maxdepth;
+    state.maxdepth = state.curdepth;
+    int empties = OPS::count_empty_squares(board);
+    cprob /= empties;
+
+    // Generate every spawn child up front: a two or four appearing in each empty square
+    typename OPS::board_type two_children[OPS::squares];
+    typename OPS::board_type four_children[OPS::squares];
+    int children = OPS::spawn_children(board, two_children, four_children);
+
+    // Children whose moves all lead straight to leaves (the depth frontier, where most nodes are) are scored together
+    // in one batch rather than recursing into each of them. Leaves never touch the cache, so scoring them first
+    // leaves everything else searched in the same order.
+    float two_scores[OPS::squares];
+    float four_scores[OPS::squares];
+    bool frontier = state.curdepth + 1 >= state.depth_limit;
+    bool two_frontier = frontier || cprob * 0.9f < state.cprob_threshold;
+    bool four_frontier = frontier || cprob * 0.1f < state.cprob_threshold;
+    if (two_frontier) score_frontier_max_nodes(state, two_children, children, two_scores);
+    if (four_frontier) score_frontier_max_nodes(state, four_children, children, four_scores);
+
+    // Above the split depth every other child is searched as a task, possibly on another thread. The cache only
+    // gives exact hits when search_threads is set, so the children score the same whichever thread searches them,
+    // and the expectation is still summed in a fixed order below.
+    bool split = state.curdepth < split_depth && task_pool.running();
+    if (split) {
+        task_group_t group;
+        basic_eval_state<OPS> child_states[2 * OPS::squares];
+        for (int i = 0; i < children; i++) {
+            if (!two_frontier) spawn_max_node(group, state, child_states[2 * i], two_children[i], cprob * 0.9f, &two_scores[i]);
+            if (!four_frontier) spawn_max_node(group, state, child_states[2 * i + 1], four_children[i], cprob * 0.1f, &four_scores[i]);
+        }
+        task_pool.wait(group);
+        for (int i = 0; i < children; i++) {
+            if (!two_frontier) merge_search_counters(state, child_states[2 * i]);
+            if (!four_frontier) merge_search_counters(state, child_states[2 * i + 1]);
+        }
+    }
+
+    // Aggregate scores in expected value
+    float expectation = 0.0f;
+    for (int i = 0; i < children; i++) {
+        if (!split && !two_frontier) two_scores[i] = score_max_node(state, two_children[i], cprob * 0.9f);
+        if (!split && !four_frontier) four_scores[i] = score_max_node(state, four_children[i], cprob * 0.1f);
+        expectation += two_scores[i] * 0.9f;
+        expectation += four_scores[i] * 0.1f;
+    }
+    expectation = expectation / empties;
+    int reached = state.maxdepth - state.curdepth;
+    state.maxdepth = std::max(outer_maxdepth, state.maxdepth);
+
+    // Add this result to the cache, unless the budget ran out part way through and left it incomplete
+    if (state.curdepth < CACHE_DEPTH_LIM && !state.aborted) {
+        int outcome = store_cache(state, board, remaining, node_cprob, expectation, reached);
+        SEARCH_STAT(state.counters.cache_stores += outcome != TT_STORE_SKIPPED;
+                    state.counters.cache_replaces += outcome == TT_STORE_REPLACED);
+        (void)outcome;
+    }
+
+    return expectation;
+
+}
+
+template <typename OPS>
+static float score_chance_node_iterative(basic_eval_state<OPS> &state, typename OPS::board_type board, float cprob) {
+    // Exactly score_chance_node, searched with this thread's frame stack. If the budget runs out the search is left
+    // suspended on the stack and, as with the recursion, the score is meaningless and state.aborted is set.
+    basic_search_stack_t<OPS> &stack = search_stack<OPS>;
+    if (!stack.start(state, board, cprob)) return 0.0f;
+    return stack.score;
+}
+
+template <typename OPS>
+bool basic_search_stack_t<OPS>::start(eval_state &state, board_type board, float cprob) {
+    // Begin searching a chance node, returning whether it finished. If it didn't, the budget ran out, and run() carries
+    // on from where it stopped once the caller has cleared state.aborted and the budget's stopped flag and extended it.
+    top = 0;
+    if (enter_chance_node(state, board, cprob, score)) return true;
+    return run(state);
+}
+
+template <typename OPS>
+bool basic_search_stack_t<OPS>::run(eval_state &state) {
+    while (top > 0) {
+        // Frames alternate chance, max, chance... from the root, so odd counts have a chance node on top
+        bool done = top % 2 ? run_chance_node(state, chance[top / 2]) : run_max_node(state, max[top / 2 - 1]);
+        if (!done && state.aborted) return false;
+    }
+    return true;
+}
+
+template <typename OPS>
+bool basic_search_stack_t<OPS>::enter_chance_node(eval_state &state, board_type board, float cprob, float &score) {
+    // The start of score_chance_node: score a leaf or a cached node straight away, returning true, or push its frame
+    SEARCH_STAT(state.counters.ply_nodes[state.curdepth]++);
+    if (state.curdepth >= state.depth_limit || cprob < state.cprob_threshold) {
+        state.maxdepth = std::max(state.curdepth, state.maxdepth);
+        SEARCH_STAT(state.counters.leaves++; if (state.curdepth < state.depth_limit) state.counters.pruned++);
+        score = OPS::score_board(board);
+        return true;
+    }
+    SEARCH_STAT(state.counters.chance_nodes++);
+    if (state.canonical && state.curdepth < CACHE_DEPTH_LIM) {
+        board = OPS::canonical(board);
+    }
+    int remaining = state.depth_limit - state.curdepth;
+    if (state.curdepth < CACHE_DEPTH_LIM) {
+        state.cacheprobes++;
+        if (probe_cache(state, board, remaining, cprob, score)) {
+            state.cachehits++;
+            return true;
+        }
+    }
+
+    basic_chance_frame_t<OPS> &frame = chance[top / 2];
+    top++;
+    frame.board = board;
+    frame.node_cprob = cprob;
+    frame.remaining = remaining;
+    frame.outer_maxdepth = state.maxdepth;
+    state.maxdepth = state.curdepth;
+    frame.empties = OPS::count_empty_squares(board);
+    frame.cprob = cprob / frame.empties;
+    frame.children = OPS::spawn_children(board, frame.two_children, frame.four_children);
+    bool frontier = state.curdepth + 1 >= state.depth_limit;
+    frame.two_frontier = frontier || frame.cprob * 0.9f < state.cprob_threshold;
+    frame.four_frontier = frontier || frame.cprob * 0.1f < state.cprob_threshold;
+    frame.stage = CHANCE_STAGE_TWO_FRONTIER;
+    frame.child = 0;
+    return false;
+}
+
+template <typename OPS>
+bool basic_search_stack_t<OPS>::run_chance_node(eval_state &state, basic_chance_frame_t<OPS> &frame) {
+    // Carry on with the chance node on top of the stack. Returns false having pushed a max node child, or having
+    // suspended, and true once the node is finished and popped.
+    if (frame.stage == CHANCE_STAGE_TWO_FRONTIER) {
+        // The budget is checked here rather than by score_frontier_max_nodes, so the batch is never left half scored
+        if (frame.two_frontier) {
+            if (state.budget && budget_exhausted(state)) return false;
+            score_frontier_max_nodes(state, frame.two_children, frame.children, frame.two_scores);
+        }
+        frame.stage = CHANCE_STAGE_FOUR_FRONTIER;
+    }
+    if (frame.stage == CHANCE_STAGE_FOUR_FRONTIER) {
+        if (frame.four_frontier) {
+            if (state.budget && budget_exhausted(state)) return false;
+            score_frontier_max_nodes(state, frame.four_children, frame.children, frame.four_scores);
+        }
+        frame.stage = CHANCE_STAGE_CHILDREN;
+    }
+    for (; frame.child < 2 * frame.children; frame.child++) {
+        bool four = frame.child % 2;
+        if (four ? frame.four_frontier : frame.two_frontier) continue;
+        // The start of score_max_node. Its score is handed back by finish_node, which also moves on to the next child.
+        if (state.budget && budget_exhausted(state)) return false;
+        basic_max_frame_t<OPS> &child = max[top / 2];
+        top++;
+        child.board = four ? frame.four_children[frame.child / 2] : frame.two_children[frame.child / 2];
+        child.cprob = frame.cprob * (four ? 0.1f : 0.9f);
+        child.score = 0.0f;
+        child.move = 0;
+        state.curdepth++;
+        SEARCH_STAT(state.counters.max_nodes++; state.counters.ply_nodes[state.curdepth]++);
+        OPS::play_all_moves(child.board, child.successors);
+        return false;
+    }
+
+    // Sum the expectation in the same order as score_chance_node, so the score is the same to the last bit
+    float expectation = 0.0f;
+    for (int i = 0; i < frame.children; i++) {
+        expectation += frame.two_scores[i] * 0.9f;
+        expectation += frame.four_scores[i] * 0.1f;
+    }
+    expectation = expectation / frame.empties;
+    int reached = state.maxdepth - state.curdepth;
+    state.maxdepth = std::max(frame.outer_maxdepth, state.maxdepth);
+    if (state.curdepth < CACHE_DEPTH_LIM) {
+        int outcome = store_cache(state, frame.board, frame.remaining, frame.node_cprob, expectation, reached);
+        SEARCH_STAT(state.counters.cache_stores += outcome != TT_STORE_SKIPPED;
+                    state.counters.cache_replaces += outcome == TT_STORE_REPLACED);
+        (void)outcome;
+    }
+    finish_node(expectation);
+    return true;
+}
+
+template <typename OPS>
+bool basic_search_stack_t<OPS>::run_max_node(eval_state &state, basic_max_frame_t<OPS> &frame) {
+    // Carry on with the max node on top of the stack. Returns false having pushed a chance node child, and true once
+    // the node is finished and popped. Chance nodes never run out of budget, so this never suspends.
+    // Work on locals, the frame only needs to be up to date when a child is pushed
+    float highest_utility = frame.score;
+    for (int move = frame.move; move < MOVE_DIRECTIONS; move++) {
+        state.moves_evaled++;
+        board_type newboard = frame.successors[move];
+        if (newboard == frame.board) continue;
+        float score;
+        if (!enter_chance_node(state, newboard, frame.cprob, score)) {
+            frame.move = move;
+            frame.score = highest_utility;
+            return false;
+        }
+        highest_utility = std::max(highest_utility, score);
+    }
+    state.curdepth--;
+    finish_node(highest_utility);
+    return true;
+}
+
+template <typename OPS>
+void basic_search_stack_t<OPS>::finish_node(float node_score) {
+    // Pop the node on top and hand its score to its parent, which moves on to its next child
+    top--;
+    if (top == 0) {
+        score = node_score;
+    } else if (top % 2) {
+        basic_chance_frame_t<OPS> &parent = chance[top / 2];
+        (parent.child % 2 ? parent.four_scores : parent.two_scores)[parent.child / 2] = node_score;
+        parent.child++;
+    } else {
+        basic_max_frame_t<OPS> &parent = max[top / 2 - 1];
+        parent.score = std::max(parent.score, node_score);
+        parent.move++;
+    }
+}
+
+template <typename BOARD>
+void basic_trans_table_t<BOARD>::resize(int bits) {
+    buckets.assign(size_t(1) << bits, basic_tt_bucket_t<BOARD>());
+    shift = 64 - bits;
+    clear();
+}
+
+template <typename BOARD>
+void basic_trans_table_t<BOARD>::clear() {
+    for (basic_tt_bucket_t<BOARD> &bucket : buckets) {
+        memset(bucket.depths, TT_EMPTY, sizeof(bucket.depths));
+    }
+    generation = 0;
+    filled = 0;
+}
+
+template <typename BOARD>
+void basic_trans_table_t<BOARD>::new_search() {
+    generation++;
+    // Once the generation wraps, old entries would look current again, so start over
+    if (generation == 0) clear();
+}
+
+template <typename BOARD>
+bool basic_trans_table_t<BOARD>::probe(BOARD board, int depth, float cprob, bool exact, bool current_only, float &score,
+                                       int &reached) {
+    size_t index = index_for(board);
+    basic_tt_bucket_t<BOARD> &bucket = buckets[index];
+    std::unique_lock<std::mutex> guard(locks[index % TT_LOCK_STRIPES], std::defer_lock);
+    if (locking) guard.lock();
+
+    for (int way = 0; way < TT_BUCKET_WAYS; way++) {
+        if (bucket.keys[way] != board || bucket.depths[way] == TT_EMPTY || (scratch && bucket.ages[way] != generation)) continue;
+        if (current_only && bucket.ages[way] != generation) return false;
+        // An exact entry is the value this node evaluates to. Otherwise any entry searched at least as deep will do.
+        bool usable = exact ? (bucket.depths[way] == depth && bucket.cprobs[way] == cprob) : bucket.depths[way] >= depth;
+        if (!usable) return false;
+        score = bucket.scores[way];
+        reached = bucket.reached[way];
+        return true;
+    }
+    return false;
+}
+
+template <typename BOARD>
+int basic_trans_table_t<BOARD>::store(BOARD board, int depth, float cprob, float score, int reached) {
+    size_t index = index_for(board);
+    basic_tt_bucket_t<BOARD> &bucket = buckets[index];
+    std::unique_lock<std::mutex> guard(locks[index % TT_LOCK_STRIPES], std::defer_lock);
+    if (locking) guard.lock();
+
+    // Depth preferred replacement: prefer the way already holding this board, then an empty way,
+    // then entries from older searches, and finally the entry with the least depth searched below it.
+    int victim = 0;
+    int victim_rank = INT32_MAX;
+    for (int way = 0; way < TT_BUCKET_WAYS; way++) {
+        int rank;
+        if (bucket.depths[way] == TT_EMPTY || (scratch && bucket.ages[way] != generation)) {
+            rank = -2;
+        } else if (bucket.keys[way] == board) {
+            rank = -3;
+        } else if (bucket.ages[way] != generation) {
+            rank = -1;
+        } else {
+            rank = bucket.depths[way];
         }
+        if (rank < victim_rank) {
+            victim = way;
+            victim_rank = rank;
+        }
+    }
+    // Never evict a deeper entry from the current search for a shallower one
+    if (victim_rank >= 0 && victim_rank > depth) return TT_STORE_SKIPPED;
+    if (victim_rank == -3 && bucket.ages[victim] == generation && bucket.depths[victim] > depth) return TT_STORE_SKIPPED;
+
+    if (bucket.depths[victim] == TT_EMPTY) filled++;
+    bucket.keys[victim] = board;
+    bucket.scores[victim] = score;
+    bucket.cprobs[victim] = cprob;
+    bucket.depths[victim] = depth;
+    bucket.reached[victim] = reached;
+    bucket.ages[victim] = generation;
+    if (victim_rank == -3) return TT_STORE_UPDATED;
+    return victim_rank == -2 ? TT_STORE_NEW : TT_STORE_REPLACED;
+}
+
+template <typename BOARD>
+void basic_tt_overlay_t<BOARD>::begin(int bits) {
+    // Sized once per thread, unless the shared tables of the boards it searches differ in size (e.g. --listen sessions)
+    if (table.buckets.size() != (size_t(1) << bits)) {
+        table.resize(bits);
+        table.scratch = true;
+        touched.clear();
+        touched.shrink_to_fit();
+        touched.reserve(table.buckets.size());
+    }
+    table.new_search();
+    touched.clear();
+}
+
+template <typename BOARD>
+int basic_tt_overlay_t<BOARD>::store(BOARD board, int depth, float cprob, float score, int reached) {
+    // A bucket joins the list the first time this search writes it. Only current entries survive in a scratch table,
+    // so the list never outgrows the bucket count and the overlay is as bounded as the shared table.
+    size_t index = table.index_for(board);
+    const basic_tt_bucket_t<BOARD> &bucket = table.buckets[index];
+    bool written = false;
+    for (int way = 0; way < TT_BUCKET_WAYS; way++) {
+        written = written || (bucket.depths[way] != TT_EMPTY && bucket.ages[way] == table.generation);
+    }
+    int stored = table.store(board, depth, cprob, score, reached);
+    if (!written && stored != TT_STORE_SKIPPED) touched.push_back(index);
+    return stored;
+}
 
-    // Take the expected score from the cache if possible
-    if (state.curdepth < CACHE_DEPTH_LIM) {
-        const cache_table_t::iterator &i = state.cache_table.find(board);
-        if (i != state.cache_table.end()) {
-            cache_entry_t entry = i->second;
-            if(entry.depth <= state.curdepth) {
-                state.cachehits++;
-                return entry.heuristic;
-            }
+template <typename BOARD>
+void basic_tt_overlay_t<BOARD>::merge_into(basic_trans_table_t<BOARD> &shared) const {
+    // Every entry the search left in the overlay, bucket by bucket in the order they were first written. A search
+    // cut short by the budget stored nothing it hadn't finished.
+    for (uint32_t index : touched) {
+        const basic_tt_bucket_t<BOARD> &bucket = table.buckets[index];
+        for (int way = 0; way < TT_BUCKET_WAYS; way++) {
+            if (bucket.depths[way] == TT_EMPTY || bucket.ages[way] != table.generation) continue;
+            shared.store(bucket.keys[way], bucket.depths[way], bucket.cprobs[way], bucket.scores[way], bucket.reached[way]);
         }
     }
+}
 
-    int empties = count_empty_squares(board);
-    cprob /= empties;
-    // Test a two or four appearing in each empty square, aggregate scores in expected value
-    float expectation = 0.0f;
-    board_t tmp = board;
-    board_t two_board = 1;
-    while (two_board) {
-        // If we hit an empty square, test it
-        if ((tmp & 0xf) == 0) {
-            expectation += score_max_node(state, board |  two_board, cprob * 0.9f) * 0.9f;
-            expectation += score_max_node(state, board | (two_board << 1), cprob * 0.1f) * 0.1f;
-        }
-        tmp >>= SQUARE_BITS;
-        two_board <<= SQUARE_BITS;
+void task_pool_t::start(int threads) {
+    queue_count = threads + 1;
+    queues.reset(new task_queue_t[queue_count]);
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&task_pool_t::worker_loop, this, i);
     }
-    expectation = expectation / empties;
+}
 
-    // Add this result to the cache
-    if (state.curdepth < CACHE_DEPTH_LIM) {
-        cache_entry_t entry = {static_cast<uint8_t>(state.curdepth), expectation};
-        state.cache_table[board] = entry;
+void task_pool_t::stop() {
+    if (!running()) return;
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers) {
+        t.join();
     }
+    workers.clear();
+}
 
-    return expectation;
+int task_pool_t::own_queue() const {
+    return pool_worker >= 0 ? pool_worker : queue_count - 1;
+}
+
+void task_pool_t::spawn(task_group_t &group, std::function<void()> run) {
+    group.pending++;
+    task_queue_t &queue = queues[own_queue()];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(search_task_t{std::move(run), &group});
+    }
+    queued++;
+    // Workers only sleep once they have seen no queued tasks, so only wake one if any are asleep
+    if (sleepers > 0) {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        wake.notify_one();
+    }
+}
+
+void task_pool_t::wait(task_group_t &group) {
+    // Help out rather than block, running our own tasks or stealing others', until the whole group has finished
+    int self = own_queue();
+    while (group.pending > 0) {
+        if (!run_one(self)) std::this_thread::yield();
+    }
+}
 
+bool task_pool_t::run_one(int self) {
+    // Take the newest task from our own queue, or failing that steal the oldest task from another queue
+    search_task_t task;
+    bool found = false;
+    for (int i = 0; i < queue_count && !found; i++) {
+        task_queue_t &queue = queues[(self + i) % queue_count];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) continue;
+        if (i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        found = true;
+    }
+    if (!found) return false;
+    queued--;
+    task.run();
+    task.group->pending--;
+    return true;
 }
 
-static inline board_t transpose_board(board_t x) {
-    // The most involved algorithm in the program, see extras/transpose.png for a visual example
-    board_t a1 = x & 0xF0F00F0FF0F00F0FULL;
-    board_t a2 = x & 0x0000F0F00000F0F0ULL;
-    board_t a3 = x & 0x0F0F00000F0F0000ULL;
-    board_t a = a1 | (a2 << 12) | (a3 >> 12);
-    board_t b1 = a & 0xFF00FF0000FF00FFULL;
-    board_t b2 = a & 0x00FF00FF00000000ULL;
-    board_t b3 = a & 0x00000000FF00FF00ULL;
-    return b1 | (b2 >> 24) | (b3 << 24);
+void task_pool_t::worker_loop(int self) {
+    pool_worker = self;
+    while (!stopping) {
+        if (run_one(self)) continue;
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        sleepers++;
+        wake.wait(guard, [this]() { return stopping || queued > 0; });
+        sleepers--;
+    }
 }
 
 board_t insert_rand_square(board_t board, board_t new_square) {
     int empties = count_empty_squares(board);
-    int index = 1;
-    // Index is used to place the new sqaure at the <index>th empty square we find
-    if (empties > 1) {
-        index = rand()%empties;
-    }
-    int empties_found=0;
+    if (board == 0) empties = BOARD_SIZE; // count_empty_squares overflows on an empty board
+    if (empties == 0) return board;
+    return insert_square_at(board, new_square, rand() % empties);
+}
+
+static board_t insert_square_at(board_t board, board_t new_square, int index) {
+    // Index is used to place the new square at the <index>th empty square we find, counting from 0
     for (int i = 0; i < BOARD_BITS; i += SQUARE_BITS) {
-        if (!((board >> i) & SQUARE_MASK)) empties_found++;
-        if (empties_found == index) {
-            board |= (new_square << i);
-            break;
+        if (!((board >> i) & SQUARE_MASK) && index-- == 0) {
+            return board | (new_square << i);
         }
     }
     return board;
 }
 
 board_t get_new_square() {
-    srand(time(NULL));
+    // The generator is seeded once by the caller. Reseeding here every call would repeat the same square all second.
     board_t new_square;
     rand()%10 < 9 ? new_square = 1 : new_square = 2;
     return new_square;
@@ -376,6 +2639,48 @@ static inline int count_distinct_tiles(board_t board) {
     return count;
 }
 
+static inline board_t mirror_rows(board_t board) {
+    // Reverse the order of the squares within every row, reflecting the board left to right.
+    // Swap the bytes of each row, then the two squares within each byte.
+    board = ((board & 0x00FF00FF00FF00FFULL) << 8) | ((board >> 8) & 0x00FF00FF00FF00FFULL);
+    return ((board & 0x0F0F0F0F0F0F0F0FULL) << 4) | ((board >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+}
+
+static inline board_t mirror_columns(board_t board) {
+    // Reverse the order of the rows, reflecting the board top to bottom
+    board = ((board & 0x0000FFFF0000FFFFULL) << 16) | ((board >> 16) & 0x0000FFFF0000FFFFULL);
+    return (board << 32) | (board >> 32);
+}
+
+static inline board_t canonical_board(board_t board) {
+    // The 8 symmetries of the square are the board and its transpose, each with every combination of the two mirrors.
+    // The smallest of the 8 boards represents them all.
+    board_t transposed = transpose_board(board);
+    board_t canonical = board;
+    for (board_t b : {board, transposed}) {
+        board_t mirrored = mirror_columns(b);
+        canonical = std::min({canonical, b, mirror_rows(b), mirrored, mirror_rows(mirrored)});
+    }
+    return canonical;
+}
+
+static inline board_t apply_symmetry(board_t board, int symmetry) {
+    // One of the 8 symmetries of canonical_board: bit 0 transposes the board, then bit 1 reflects it left to right
+    // and bit 2 top to bottom
+    if (symmetry & 1) board = transpose_board(board);
+    if (symmetry & 2) board = mirror_rows(board);
+    if (symmetry & 4) board = mirror_columns(board);
+    return board;
+}
+
+static inline int symmetric_move(int move, int symmetry) {
+    // The move on apply_symmetry(board, symmetry) that does what move does on board
+    if (symmetry & 1) move ^= 2; // a transpose swaps up with left and down with right
+    if ((symmetry & 2) && move >= 2) move ^= 1; // left with right
+    if ((symmetry & 4) && move < 2) move ^= 1; // up with down
+    return move;
+}
+
 // Pick one of the moves. Moves use index codes such that this function can be looped through with fewer operations.
 static inline board_t play_move(int move, board_t board) {
     switch(move) {
@@ -436,6 +2741,968 @@ static inline board_t play_move_right(board_t board) {
     return result;
 }
 
+static inline void play_all_moves(board_t board, board_t *successors) {
+    // All four moves at once, in play_move order. Every row of the board and every row of its transpose (a column of
+    // the board) is looked up once, and its record gives both of its moves. Compared to four play_move calls this
+    // does half the lookups, in one table rather than four, and transposes once rather than twice.
+    board_t transposed_board = transpose_board(board);
+    board_t up = 0, down = 0, left = 0, right = 0;
+    for (int row = 0; row < ROW_SIZE; row++) {
+        const row_moves_t &horizontal = row_moves_table[(board >> (row * ROW_BITS)) & ROW_MASK];
+        const row_moves_t &vertical = row_moves_table[(transposed_board >> (row * ROW_BITS)) & ROW_MASK];
+        left |= board_t(horizontal.left) << (row * ROW_BITS);
+        right |= board_t(horizontal.right) << (row * ROW_BITS);
+        up |= vertical.up << (row * SQUARE_BITS);
+        down |= vertical.down << (row * SQUARE_BITS);
+    }
+    successors[0] = up;
+    successors[1] = down;
+    successors[2] = left;
+    successors[3] = right;
+}
+
+inline int board_ops_t<ROW_SIZE, SQUARE_BITS>::spawn_children(board_t board, board_t *two_children, board_t *four_children) {
+    // Every board a two or a four spawning in an empty square makes, in square order, returning the empty square count
+    int children = 0;
+    board_t tmp = board;
+    for (board_t two_board = 1; two_board; two_board <<= SQUARE_BITS) {
+        // If we hit an empty square, test it
+        if ((tmp & 0xf) == 0) {
+            two_children[children] = board | two_board;
+            four_children[children] = board | (two_board << 1);
+            children++;
+        }
+        tmp >>= SQUARE_BITS;
+    }
+    return children;
+}
+
+void run_move_benchmark(int boards, uint64_t seed) {
+    // Time the fused move generator against four calls to play_move over the same boards
+    rng_t rng(seed);
+    std::vector<board_t> positions = random_game_boards(boards, rng);
+
+    // Repeat until each side has run for a while, alternating between the two and keeping the best time of each,
+    // and check the two agree on every board
+    int rounds = std::max(1, 20000000 / boards);
+    board_t checksum[2] = {0, 0};
+    double ns[2] = {INFINITY, INFINITY};
+    for (int trial = 0; trial < 2 * MOVE_BENCH_TRIALS; trial++) {
+        int fused = trial % 2;
+        checksum[fused] = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            for (board_t board : positions) {
+                board_t successors[MOVE_DIRECTIONS];
+                if (fused) {
+                    play_all_moves(board, successors);
+                } else {
+                    for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+                        successors[move] = play_move(move, board);
+                    }
+                }
+                checksum[fused] += successors[0] ^ (successors[1] * 3) ^ (successors[2] * 5) ^ (successors[3] * 7);
+            }
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        ns[fused] = std::min(ns[fused], elapsed / ((double)rounds * boards));
+    }
+    printf("boards:     %d (%d rounds)\n", boards, rounds);
+    printf("play_move:  %.2f ns/board\n", ns[0]);
+    printf("fused:      %.2f ns/board (%.2fx)\n", ns[1], ns[0] / ns[1]);
+    printf("results:    %s\n", checksum[0] == checksum[1] ? "identical" : "DIFFERENT");
+}
+
+static std::vector<board_t> random_game_boards(int boards, rng_t &rng) {
+    // Boards from games of random moves, so they have realistic rows rather than uniformly random ones, shuffled
+    std::vector<board_t> positions;
+    int position, rank;
+    while ((int)positions.size() < boards) {
+        board_t board = spawn_square<default_ops_t>(0, rng, &position, &rank);
+        board = spawn_square<default_ops_t>(board, rng, &position, &rank);
+        while ((int)positions.size() < boards) {
+            board_t successors[MOVE_DIRECTIONS];
+            int legal[MOVE_DIRECTIONS];
+            int legal_count = 0;
+            play_all_moves(board, successors);
+            for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+                if (successors[move] != board) legal[legal_count++] = move;
+            }
+            if (!legal_count) break;
+            positions.push_back(board);
+            board = spawn_square<default_ops_t>(successors[legal[rng.below(legal_count)]], rng, &position, &rank);
+        }
+    }
+    for (int i = boards - 1; i > 0; i--) {
+        std::swap(positions[i], positions[rng.below(i + 1)]);
+    }
+    return positions;
+}
+
+void run_search_benchmark(int boards, uint64_t seed) {
+    // Time the iterative search against the recursive one, searching every root move of the same boards to the depth
+    // the depth policy plans. Each run starts from a cleared table and searches the boards in the same order, so the
+    // two should agree on every score to the last bit. A third, untimed run stops the iterative search every
+    // SEARCH_BENCH_SLICE nodes and resumes it, which mustn't change a score either.
+    rng_t rng(seed);
+    std::vector<board_t> positions = random_game_boards(boards, rng);
+    stats_format = STATS_OFF;
+    std::vector<float> scores[3];
+    unsigned long nodes[3] = {0, 0, 0};
+    double ms[2] = {INFINITY, INFINITY};
+    for (int trial = 0; trial < 2 * SEARCH_BENCH_TRIALS; trial++) {
+        int iterative = trial % 2;
+        iterative_search = iterative;
+        ms[iterative] = std::min(ms[iterative], search_boards(trans_table, positions, 0, scores[iterative], &nodes[iterative]));
+    }
+    iterative_search = true;
+    search_boards(trans_table, positions, SEARCH_BENCH_SLICE, scores[2], &nodes[2]);
+    iterative_search = false;
+
+    printf("boards:     %d\n", boards);
+    printf("recursive:  %.1f ms, %.0f nodes/s\n", ms[0], nodes[0] / ms[0] * 1000);
+    printf("iterative:  %.1f ms, %.0f nodes/s (%.2fx)\n", ms[1], nodes[1] / ms[1] * 1000, ms[0] / ms[1]);
+    printf("results:    %s\n", scores[0] == scores[1] && nodes[0] == nodes[1] ? "identical" : "DIFFERENT");
+    printf("resumed:    %s\n", scores[1] == scores[2] && nodes[1] == nodes[2] ? "identical" : "DIFFERENT");
+    if (search_threads < 2) return;
+
+    // The root moves searched on the pool against the serial search of --threads 0, which must score every board the
+    // same. The boards share the table as the moves of a game do, so the entries merged after each board are checked
+    // too. With splitting, which task stores an entry first changes the node count but not the scores.
+    std::vector<float> root_scores[2];
+    unsigned long root_nodes[2] = {0, 0};
+    int threads = search_threads;
+    search_threads = 0;
+    search_root_boards(trans_table, positions, root_scores[0], &root_nodes[0]);
+    search_threads = threads;
+    task_pool.start(search_threads - 1);
+    search_root_boards(trans_table, positions, root_scores[1], &root_nodes[1]);
+    printf("threads:    %s with %d threads and with --threads 0, %+.1f%% nodes\n",
+           root_scores[0] == root_scores[1] && (split_depth > 0 || root_nodes[0] == root_nodes[1]) ? "identical" : "DIFFERENT",
+           search_threads, 100.0 * root_nodes[1] / root_nodes[0] - 100);
+}
+
+bool run_regression() {
+    // Search every regression board to the depth rule, within a time budget, within a node budget and under the
+    // adaptive policy, each from an empty table. Any other search flag applies too. A board fails if a search resigns
+    // or picks a move that doesn't change the board while a legal move exists. The shallow boards then fail if a
+    // budgeted search of them doesn't stop deepening once the cutoff has stopped every branch.
+    stats_format = STATS_OFF;
+    adaptive_depth_policy_t adaptive;
+    adaptive.target_nodes = REGRESSION_TARGET_NODES;
+    int failures = 0;
+    for (board_t board : regression_boards) {
+        bool legal = false;
+        for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+            legal = legal || play_move(move, board) != board;
+        }
+        for (int mode = 0; mode < 4; mode++) {
+            const char *names[] = {"depth", "time", "nodes", "adaptive"};
+            depth_policy_t *policy = depth_policy;
+            if (mode == 3) depth_policy = &adaptive;
+            trans_table.clear();
+            move_result_t result;
+            select_move(board, result, trans_table, mode == 1 ? REGRESSION_TIME_MS : 0, mode == 2 ? REGRESSION_NODES : 0);
+            depth_policy = policy;
+            bool ok = legal ? result.move >= 0 && play_move(result.move, board) != board : result.move < 0;
+            printf("%llu %-8s move %2d depth %2d %s\n", (unsigned long long)board, names[mode], result.move,
+                   result.depth, ok ? "ok" : "FAILED");
+            failures += !ok;
+        }
+    }
+    for (board_t board : shallow_regression_boards) {
+        // Searched within each budget. Deepening must stop below ID_MAX_DEPTH, well inside the node budget.
+        for (int mode = 1; mode < 3; mode++) {
+            const char *names[] = {"", "time", "nodes"};
+            trans_table.clear();
+            move_result_t result;
+            select_move(board, result, trans_table, mode == 1 ? REGRESSION_TIME_MS : 0, mode == 2 ? REGRESSION_NODES : 0);
+            bool ok = result.move >= 0 && result.depth < ID_MAX_DEPTH && result.moves_evaled < REGRESSION_NODES;
+            printf("%llu %-8s move %2d depth %2d %s\n", (unsigned long long)board, names[mode], result.move,
+                   result.depth, ok ? "ok" : "FAILED");
+            failures += !ok;
+        }
+    }
+    printf("%d of %zu searches failed\n", failures,
+           4 * sizeof(regression_boards) / sizeof(regression_boards[0]) +
+           2 * sizeof(shallow_regression_boards) / sizeof(shallow_regression_boards[0]));
+    return failures == 0;
+}
+
+static double search_boards(trans_table_t &table, const std::vector<board_t> &boards, int slice, std::vector<float> &scores,
+                            unsigned long *nodes) {
+    // Search every root move of every board in turn from a cleared table, returning the time taken. With a slice, the
+    // iterative search is suspended every slice nodes and resumed, as a search with a deadline would be.
+    table.clear();
+    scores.clear();
+    *nodes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (board_t board : boards) {
+        search_plan_t plan = depth_policy->plan(board_features<default_ops_t>(board));
+        for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+            board_t move_board = play_move(move, board);
+            if (move_board == board) {
+                scores.push_back(0);
+                continue;
+            }
+            search_budget_t budget;
+            budget.node_limit = slice;
+            eval_state state;
+            state.table = &table;
+            state.canonical = use_symmetry;
+            state.depth_limit = plan.depth_limit;
+            state.cprob_threshold = plan.cprob_threshold;
+            state.budget = slice ? &budget : nullptr;
+            state.next_budget_check = BUDGET_CHECK_INTERVAL;
+            if (!slice) {
+                scores.push_back(iterative_search ? score_chance_node_iterative(state, move_board, 1.0f)
+                                                  : score_chance_node(state, move_board, 1.0f));
+            } else {
+                bool finished = search_stack<default_ops_t>.start(state, move_board, 1.0f);
+                while (!finished) {
+                    budget.node_limit += slice;
+                    budget.stopped = false;
+                    state.aborted = false;
+                    finished = search_stack<default_ops_t>.run(state);
+                }
+                scores.push_back(search_stack<default_ops_t>.score);
+            }
+            *nodes += state.moves_evaled;
+        }
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void search_root_boards(trans_table_t &table, const std::vector<board_t> &boards, std::vector<float> &scores,
+                               unsigned long *nodes) {
+    // Search every board with search_root_moves as a game would, from a cleared table that the boards then share
+    table.clear();
+    scores.clear();
+    *nodes = 0;
+    for (board_t board : boards) {
+        move_result_t result;
+        table.new_search();
+        search_plan_t plan = depth_policy->plan(board_features<default_ops_t>(board));
+        search_root_moves<default_ops_t>(table, board, plan, nullptr, result, nullptr);
+        scores.insert(scores.end(), result.scores, result.scores + MOVE_DIRECTIONS);
+        *nodes += result.moves_evaled;
+    }
+}
+
+template <int GRID, int TILE_BITS>
+std::vector<typename board_ops_t<GRID, TILE_BITS>::row_record_t> board_ops_t<GRID, TILE_BITS>::row_records;
+template <int GRID, int TILE_BITS> std::vector<float> board_ops_t<GRID, TILE_BITS>::heur_score_table;
+template <int GRID, int TILE_BITS> std::vector<float> board_ops_t<GRID, TILE_BITS>::score_table;
+
+template <int GRID, int TILE_BITS>
+void board_ops_t<GRID, TILE_BITS>::init(const heur_weights_t &weights) {
+    // The rows tableGen.cpp computes for the 4x4 board, built at startup rather than compiled in for every geometry
+    size_t size = size_t(1) << row_bits;
+    row_records.resize(size);
+    heur_score_table.resize(size);
+    score_table.resize(size);
+    build_heur_rows<GRID, TILE_BITS>(weights, heur_score_table.data());
+    for (unsigned row = 0; row < size; row++) {
+        unsigned left, right;
+        shift_row<GRID, TILE_BITS>(row, &left, &right);
+        row_record_t &record = row_records[row];
+        record.left = left;
+        record.right = right;
+        record.reversed = 0;
+        record.column = 0;
+        float score = 0.0f;
+        for (int i = 0; i < GRID; i++) {
+            unsigned tile = (row >> (i * TILE_BITS)) & max_rank;
+            record.reversed |= tile << ((GRID - 1 - i) * TILE_BITS);
+            record.column |= (board_type)tile << (i * row_bits);
+            // The tile and every tile merged into it, as in tableGen.cpp. Wider squares overflow an int, hence the float.
+            if (tile >= 2) score += (tile - 1) * (float)(1u << tile);
+        }
+        score_table[row] = score;
+    }
+    // A column moved up is the row moved left spread back out into a column, and moved down the row moved right
+    for (row_record_t &record : row_records) {
+        record.up = row_records[record.left].column;
+        record.down = row_records[record.right].column;
+    }
+}
+
+template <int GRID, int TILE_BITS>
+inline typename board_ops_t<GRID, TILE_BITS>::board_type
+board_ops_t<GRID, TILE_BITS>::transpose(board_type board) {
+    // Row r of the board is column r of the transpose
+    board_type result = 0;
+    for (int row = 0; row < GRID; row++) {
+        result |= row_records[get_row(board, row)].column << (row * TILE_BITS);
+    }
+    return result;
+}
+
+template <int GRID, int TILE_BITS>
+inline typename board_ops_t<GRID, TILE_BITS>::board_type
+board_ops_t<GRID, TILE_BITS>::mirror_rows(board_type board) {
+    // Reverse the order of the squares within every row, reflecting the board left to right
+    board_type result = 0;
+    for (int row = 0; row < GRID; row++) {
+        result |= (board_type)row_records[get_row(board, row)].reversed << (row * row_bits);
+    }
+    return result;
+}
+
+template <int GRID, int TILE_BITS>
+inline typename board_ops_t<GRID, TILE_BITS>::board_type
+board_ops_t<GRID, TILE_BITS>::mirror_columns(board_type board) {
+    // Reverse the order of the rows, reflecting the board top to bottom
+    board_type result = 0;
+    for (int row = 0; row < GRID; row++) {
+        result |= (board_type)get_row(board, row) << ((GRID - 1 - row) * row_bits);
+    }
+    return result;
+}
+
+template <int GRID, int TILE_BITS>
+inline typename board_ops_t<GRID, TILE_BITS>::board_type
+board_ops_t<GRID, TILE_BITS>::canonical(board_type board) {
+    // The smallest of the 8 symmetries, as canonical_board picks for the 4x4 board
+    board_type transposed = transpose(board);
+    board_type canonical = board;
+    for (board_type b : {board, transposed}) {
+        board_type mirrored = mirror_columns(b);
+        canonical = std::min({canonical, b, mirror_rows(b), mirrored, mirror_rows(mirrored)});
+    }
+    return canonical;
+}
+
+template <int GRID, int TILE_BITS>
+inline int board_ops_t<GRID, TILE_BITS>::count_empty_squares(board_type board) {
+    // OR every bit of a square down into its lowest bit, which is then clear only for an empty square
+    board_type x = board;
+    for (int bit = 1; bit < TILE_BITS; bit++) {
+        x |= board >> bit;
+    }
+    return board_popcount(~x & square_lows);
+}
+
+template <int GRID, int TILE_BITS>
+inline int board_ops_t<GRID, TILE_BITS>::count_distinct_tiles(board_type board) {
+    uint64_t bitset = 0;
+    for (int square = 0; square < squares; square++) {
+        bitset |= 1ULL << get_square(board, square);
+    }
+    // Don't count empty tiles
+    return __builtin_popcountll(bitset >> 1);
+}
+
+template <int GRID, int TILE_BITS>
+inline int board_ops_t<GRID, TILE_BITS>::max_tile_rank(board_type board) {
+    int rank = 0;
+    for (int square = 0; square < squares; square++) {
+        rank = std::max(rank, get_square(board, square));
+    }
+    return rank;
+}
+
+template <int GRID, int TILE_BITS>
+inline int board_ops_t<GRID, TILE_BITS>::spawn_children(board_type board, board_type *two_children, board_type *four_children) {
+    // Every board a two or a four spawning in an empty square makes, in square order, returning the empty square count
+    int children = 0;
+    board_type tmp = board;
+    for (int square = 0; square < squares; square++) {
+        if ((tmp & max_rank) == 0) {
+            board_type two = board_type(1) << (square * TILE_BITS);
+            two_children[children] = board | two;
+            four_children[children] = board | (two << 1);
+            children++;
+        }
+        tmp >>= TILE_BITS;
+    }
+    return children;
+}
+
+template <int GRID, int TILE_BITS>
+inline typename board_ops_t<GRID, TILE_BITS>::board_type
+board_ops_t<GRID, TILE_BITS>::insert_square_at(board_type board, int rank, int index) {
+    // Place the new square at the <index>th empty square, counting from 0, as insert_square_at does
+    for (int square = 0; square < squares; square++) {
+        if (get_square(board, square) == 0 && index-- == 0) {
+            return board | ((board_type)rank << (square * TILE_BITS));
+        }
+    }
+    return board;
+}
+
+template <int GRID, int TILE_BITS>
+inline typename board_ops_t<GRID, TILE_BITS>::board_type
+board_ops_t<GRID, TILE_BITS>::play_move(int move, board_type board) {
+    // Only the root and the games play single moves, so they take one of all four rather than a path of their own
+    board_type successors[MOVE_DIRECTIONS];
+    play_all_moves(board, successors);
+    return successors[move];
+}
+
+template <int GRID, int TILE_BITS>
+inline void board_ops_t<GRID, TILE_BITS>::play_all_moves(board_type board, board_type *successors) {
+    // As play_all_moves does for the 4x4 board: one record per row of the board and per row of its transpose
+    board_type transposed = transpose(board);
+    board_type up = 0, down = 0, left = 0, right = 0;
+    for (int row = 0; row < GRID; row++) {
+        const row_record_t &horizontal = row_records[get_row(board, row)];
+        const row_record_t &vertical = row_records[get_row(transposed, row)];
+        left |= (board_type)horizontal.left << (row * row_bits);
+        right |= (board_type)horizontal.right << (row * row_bits);
+        up |= vertical.up << (row * TILE_BITS);
+        down |= vertical.down << (row * TILE_BITS);
+    }
+    successors[0] = up;
+    successors[1] = down;
+    successors[2] = left;
+    successors[3] = right;
+}
+
+template <int GRID, int TILE_BITS>
+inline float board_ops_t<GRID, TILE_BITS>::score_board(board_type board) {
+    // The heuristic of every row and every column, as heuristic_evaluator_t scores the 4x4 board
+    // Rows and columns are summed apart and then added, so the 4x4 board scores bit for bit as the engine scores it
+    board_type transposed = transpose(board);
+    float rows = 0;
+    float columns = 0;
+    for (int row = 0; row < GRID; row++) {
+        rows += heur_score_table[get_row(board, row)];
+        columns += heur_score_table[get_row(transposed, row)];
+    }
+    return rows + columns;
+}
+
+template <int GRID, int TILE_BITS>
+inline void board_ops_t<GRID, TILE_BITS>::score_boards(const board_type *boards, int count, float *scores) {
+    // The AVX2 kernel packs four 64 bit boards to a register, so the other geometries score their leaves one by one
+    for (int i = 0; i < count; i++) {
+        scores[i] = score_board(boards[i]);
+    }
+}
+
+template <int GRID, int TILE_BITS>
+unsigned long board_ops_t<GRID, TILE_BITS>::score_game_board(board_type board) {
+    float score = 0;
+    for (int row = 0; row < GRID; row++) {
+        score += score_table[get_row(board, row)];
+    }
+    return (unsigned long)score;
+}
+
+static bool variant_supported(int grid, int tile_bits) {
+    if (tile_bits == 5) return grid == 4;
+    return tile_bits == 4 && grid >= 3 && grid <= 5;
+}
+
+static std::vector<game_stats_t> play_variant_games(int grid, int tile_bits, int games, uint64_t seed, int jobs) {
+    // Each supported geometry is its own instantiation of the games and everything they search with, so every one of
+    // them is compiled with its sizes as constants
+    if (grid == 3) return play_headless_games<board_ops_t<3, 4>>(games, seed, jobs);
+    if (grid == 5) return play_headless_games<board_ops_t<5, 4>>(games, seed, jobs);
+    if (tile_bits == 5) return play_headless_games<board_ops_t<4, 5>>(games, seed, jobs);
+    return play_headless_games<default_ops_t>(games, seed, jobs);
+}
+
+ntuple_network_t::~ntuple_network_t() {
+    if (mapping) munmap(mapping, mapping_size);
+}
+
+void ntuple_network_t::init(int tuples, const int *counts, const uint8_t (*tuple_cells)[NTUPLE_MAX_CELLS]) {
+    // Lay out the tuples and work out where each cell lands under each symmetry. Weights are owned and zeroed,
+    // unless map() points them at a file afterwards.
+    tuple_count = tuples;
+    size_t total = 0;
+    for (int t = 0; t < tuple_count; t++) {
+        cell_counts[t] = counts[t];
+        total += size_t(1) << (SQUARE_BITS * counts[t]);
+        for (int k = 0; k < cell_counts[t]; k++) {
+            cells[t][k] = tuple_cells[t][k];
+            int row = cells[t][k] / ROW_SIZE;
+            int col = cells[t][k] % ROW_SIZE;
+            int flip_row = ROW_SIZE - 1 - row;
+            int flip_col = ROW_SIZE - 1 - col;
+            // The 8 rotations and reflections, as (row, column) pairs
+            int symmetric[NTUPLE_SYMMETRIES][2] = {
+                {row, col}, {col, row}, {row, flip_col}, {flip_row, col},
+                {col, flip_row}, {flip_col, row}, {flip_row, flip_col}, {flip_col, flip_row},
+            };
+            for (int sym = 0; sym < NTUPLE_SYMMETRIES; sym++) {
+                shifts[t][sym][k] = (symmetric[sym][0] * ROW_SIZE + symmetric[sym][1]) * SQUARE_BITS;
+            }
+        }
+    }
+    owned.assign(total, 0.0f);
+    float *next = owned.data();
+    for (int t = 0; t < tuple_count; t++) {
+        weights[t] = next;
+        next += size_t(1) << (SQUARE_BITS * cell_counts[t]);
+    }
+}
+
+bool ntuple_network_t::map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < NTUPLE_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    void *file = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return false;
+
+    // Check the header describes a sensible network that exactly fills the file
+    const ntuple_header_t *header = (const ntuple_header_t *)file;
+    bool valid = header->magic == NTUPLE_MAGIC && header->version == NTUPLE_VERSION &&
+                 header->tuple_count > 0 && header->tuple_count <= NTUPLE_MAX_TUPLES;
+    int counts[NTUPLE_MAX_TUPLES];
+    size_t total = 0;
+    for (uint32_t t = 0; valid && t < header->tuple_count; t++) {
+        counts[t] = header->cell_counts[t];
+        valid = counts[t] > 0 && counts[t] <= NTUPLE_MAX_CELLS;
+        for (int k = 0; valid && k < counts[t]; k++) {
+            valid = header->cells[t][k] < BOARD_SIZE;
+        }
+        if (valid) total += size_t(1) << (SQUARE_BITS * counts[t]);
+    }
+    if (!valid || (size_t)info.st_size != NTUPLE_HEADER_SIZE + total * sizeof(float)) {
+        munmap(file, info.st_size);
+        return false;
+    }
+
+    init(header->tuple_count, counts, header->cells);
+    owned = std::vector<float>();
+    float *next = (float *)((char *)file + NTUPLE_HEADER_SIZE);
+    for (int t = 0; t < tuple_count; t++) {
+        weights[t] = next;
+        next += size_t(1) << (SQUARE_BITS * cell_counts[t]);
+    }
+    if (mapping) munmap(mapping, mapping_size);
+    mapping = file;
+    mapping_size = info.st_size;
+    return true;
+}
+
+bool ntuple_network_t::read(const char *path) {
+    // Load a copy of the weights that can be trained further
+    if (!map(path)) return false;
+    std::vector<float> copy;
+    for (int t = 0; t < tuple_count; t++) {
+        copy.insert(copy.end(), weights[t], weights[t] + (size_t(1) << (SQUARE_BITS * cell_counts[t])));
+    }
+    owned.swap(copy);
+    float *next = owned.data();
+    for (int t = 0; t < tuple_count; t++) {
+        weights[t] = next;
+        next += size_t(1) << (SQUARE_BITS * cell_counts[t]);
+    }
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+    return true;
+}
+
+bool ntuple_network_t::write(const char *path) const {
+    // Write to a temporary file and rename it over the old one, so engines that have the old file mapped keep a
+    // complete copy and an interrupted write never leaves a truncated file behind
+    char header_bytes[NTUPLE_HEADER_SIZE] = {0};
+    ntuple_header_t *header = (ntuple_header_t *)header_bytes;
+    header->magic = NTUPLE_MAGIC;
+    header->version = NTUPLE_VERSION;
+    header->tuple_count = tuple_count;
+    for (int t = 0; t < tuple_count; t++) {
+        header->cell_counts[t] = cell_counts[t];
+        memcpy(header->cells[t], cells[t], NTUPLE_MAX_CELLS);
+    }
+
+    std::string temp_path = std::string(path) + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(header_bytes, 1, NTUPLE_HEADER_SIZE, file) == NTUPLE_HEADER_SIZE;
+    for (int t = 0; ok && t < tuple_count; t++) {
+        size_t count = size_t(1) << (SQUARE_BITS * cell_counts[t]);
+        ok = fwrite(weights[t], sizeof(float), count, file) == count;
+    }
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temp_path.c_str(), path) == 0;
+}
+
+float ntuple_network_t::value(board_t board) const {
+    float total = 0.0f;
+    for (int t = 0; t < tuple_count; t++) {
+        for (int sym = 0; sym < NTUPLE_SYMMETRIES; sym++) {
+            size_t index = 0;
+            for (int k = 0; k < cell_counts[t]; k++) {
+                index = (index << SQUARE_BITS) | ((board >> shifts[t][sym][k]) & SQUARE_MASK);
+            }
+            total += weights[t][index];
+        }
+    }
+    return total;
+}
+
+void ntuple_network_t::update(board_t board, float delta) {
+    // Move every weight that contributed to the board's value by delta
+    for (int t = 0; t < tuple_count; t++) {
+        for (int sym = 0; sym < NTUPLE_SYMMETRIES; sym++) {
+            size_t index = 0;
+            for (int k = 0; k < cell_counts[t]; k++) {
+                index = (index << SQUARE_BITS) | ((board >> shifts[t][sym][k]) & SQUARE_MASK);
+            }
+            weights[t][index] += delta;
+        }
+    }
+}
+
+void run_ntuple_training(const char *path, int games, int tuple_size, float alpha, uint64_t seed) {
+    // Temporal difference learning of afterstate values over games of greedy self play (Szubert and Jaskowski, 2014).
+    // Each move is chosen by the reward it earns plus the value of the afterstate it leaves, and the previous
+    // afterstate's value is moved towards that same quantity. Training continues from the file if it already exists.
+    static const uint8_t small_tuples[][NTUPLE_MAX_CELLS] = {
+        {0, 1, 2, 3}, {4, 5, 6, 7}, // the outer and inner rows
+        {0, 1, 4, 5}, {1, 2, 5, 6}, {5, 6, 9, 10}, // the corner, edge and centre squares
+    };
+    static const int small_counts[] = {4, 4, 4, 4, 4};
+    static const uint8_t large_tuples[][NTUPLE_MAX_CELLS] = {
+        {0, 1, 2, 3, 4, 5}, {4, 5, 6, 7, 8, 9}, {0, 1, 2, 4, 5, 6}, {4, 5, 6, 8, 9, 10},
+    };
+    static const int large_counts[] = {6, 6, 6, 6};
+
+    ntuple_network_t network;
+    if (network.read(path)) {
+        printf("Continuing training of %s\n", path);
+    } else if (tuple_size == 6) {
+        network.init(4, large_counts, large_tuples);
+    } else {
+        network.init(5, small_counts, small_tuples);
+    }
+    // alpha is the step for a board's whole value, shared between the weights that make it up
+    float rate = alpha / (network.tuple_count * NTUPLE_SYMMETRIES);
+    rng_t rng(seed);
+
+    double interval_score = 0;
+    int interval_reached = 0;
+    unsigned long interval_best = 0;
+    for (int game = 1; game <= games; game++) {
+        int position, rank;
+        board_t board = spawn_square<default_ops_t>(0, rng, &position, &rank);
+        board = spawn_square<default_ops_t>(board, rng, &position, &rank);
+        board_t last_afterstate = 0;
+        bool started = false;
+        unsigned long score = 0;
+        while (true) {
+            board_t successors[MOVE_DIRECTIONS];
+            play_all_moves(board, successors);
+            int best_move = -1;
+            float best_value = 0;
+            unsigned long best_reward = 0;
+            for (int move = 0; move < MOVE_DIRECTIONS; move++) {
+                if (successors[move] == board) continue;
+                // Merges are the only thing that adds to the score, so the reward is the change in score
+                unsigned long reward = score_game_board(successors[move]) - score_game_board(board);
+                float value = reward + network.value(successors[move]);
+                if (best_move < 0 || value > best_value) {
+                    best_move = move;
+                    best_value = value;
+                    best_reward = reward;
+                }
+            }
+            if (best_move < 0) break;
+
+            if (started) network.update(last_afterstate, rate * (best_value - network.value(last_afterstate)));
+            last_afterstate = successors[best_move];
+            started = true;
+            score += best_reward;
+            board = spawn_square<default_ops_t>(last_afterstate, rng, &position, &rank);
+        }
+        // Nothing more can be scored from the final afterstate
+        if (started) network.update(last_afterstate, rate * -network.value(last_afterstate));
+
+        interval_score += score;
+        interval_best = std::max(interval_best, score);
+        if (max_tile_rank(board) >= 11) interval_reached++;
+        if (game % NTUPLE_REPORT_INTERVAL == 0 || game == games) {
+            int played = (game - 1) % NTUPLE_REPORT_INTERVAL + 1;
+            printf("games %d: mean score %.0f, best %lu, 2048 reached %.1f%%\n", game, interval_score / played,
+                   interval_best, 100.0 * interval_reached / played);
+            fflush(stdout);
+            interval_score = 0;
+            interval_reached = 0;
+            interval_best = 0;
+            if (!network.write(path)) fprintf(stderr, "Couldn't write %s\n", path);
+        }
+    }
+}
+
+// The fields of heur_weights_t in order, and the tableGen.cpp settings they come from
+static float heur_weights_t::*const heur_weight_fields[HEUR_WEIGHT_COUNT] = {
+    &heur_weights_t::lost_penalty, &heur_weights_t::monotonicity_power, &heur_weights_t::monotonicity_weight,
+    &heur_weights_t::sum_power, &heur_weights_t::sum_weight, &heur_weights_t::merges_weight, &heur_weights_t::empty_weight,
+};
+static const char *const heur_weight_names[HEUR_WEIGHT_COUNT] = {
+    "SCORE_LOST_PENALTY", "SCORE_MONOTONICITY_POWER", "SCORE_MONOTONICITY_WEIGHT", "SCORE_SUM_POWER",
+    "SCORE_SUM_WEIGHT", "SCORE_MERGES_WEIGHT", "SCORE_EMPTY_WEIGHT",
+};
+
+static heur_weights_t tune_weights(const double *x) {
+    heur_weights_t weights = heur_table_weights;
+    for (int i = 0; i < HEUR_WEIGHT_COUNT; i++) {
+        weights.*heur_weight_fields[i] = heur_table_weights.*heur_weight_fields[i] * exp(x[i]);
+    }
+    return weights;
+}
+
+void tune_state_t::init() {
+    generation = 0;
+    sigma = TUNE_INITIAL_SIGMA;
+    best_score = -1;
+    for (int i = 0; i < HEUR_WEIGHT_COUNT; i++) {
+        mean[i] = path_c[i] = path_sigma[i] = best[i] = 0;
+        for (int j = 0; j < HEUR_WEIGHT_COUNT; j++) {
+            cov[i][j] = i == j ? 1 : 0;
+        }
+    }
+}
+
+bool tune_state_t::read(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    int version = 0;
+    bool ok = fscanf(file, " tune %d", &version) == 1 && version == TUNE_CHECKPOINT_VERSION &&
+              fscanf(file, " generation %d sigma %lf best_score %lf", &generation, &sigma, &best_score) == 3;
+    auto read_vector = [&](const char *name, double *vector) {
+        char label[32];
+        ok = ok && fscanf(file, " %31s", label) == 1 && strcmp(label, name) == 0;
+        for (int i = 0; ok && i < HEUR_WEIGHT_COUNT; i++) {
+            ok = fscanf(file, "%lf", &vector[i]) == 1;
+        }
+    };
+    read_vector("mean", mean);
+    read_vector("path_c", path_c);
+    read_vector("path_sigma", path_sigma);
+    read_vector("best", best);
+    for (int i = 0; i < HEUR_WEIGHT_COUNT; i++) {
+        read_vector("cov", cov[i]);
+    }
+    fclose(file);
+    return ok;
+}
+
+bool tune_state_t::write(const char *path) const {
+    // Written as text, with enough digits to read back exactly, to a temporary file renamed over the old one
+    std::string temp_path = std::string(path) + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "w");
+    if (!file) return false;
+    fprintf(file, "tune %d\ngeneration %d\nsigma %.17g\nbest_score %.17g\n", TUNE_CHECKPOINT_VERSION, generation, sigma,
+            best_score);
+    auto write_vector = [&](const char *name, const double *vector) {
+        fprintf(file, "%s", name);
+        for (int i = 0; i < HEUR_WEIGHT_COUNT; i++) {
+            fprintf(file, " %.17g", vector[i]);
+        }
+        fprintf(file, "\n");
+    };
+    write_vector("mean", mean);
+    write_vector("path_c", path_c);
+    write_vector("path_sigma", path_sigma);
+    write_vector("best", best);
+    for (int i = 0; i < HEUR_WEIGHT_COUNT; i++) {
+        write_vector("cov", cov[i]);
+    }
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temp_path.c_str(), path) == 0;
+}
+
+static void symmetric_eigen(const double (*matrix)[HEUR_WEIGHT_COUNT], double (*vectors)[HEUR_WEIGHT_COUNT], double *values) {
+    // Cyclic Jacobi rotations, which converge in a handful of sweeps at this size.
+    // Column j of vectors is the eigenvector with eigenvalue values[j].
+    const int n = HEUR_WEIGHT_COUNT;
+    double a[n][n];
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            a[i][j] = matrix[i][j];
+            vectors[i][j] = i == j ? 1 : 0;
+        }
+    }
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off_diagonal = 0;
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) off_diagonal += a[p][q] * a[p][q];
+        }
+        if (off_diagonal < 1e-30) break;
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) {
+                if (a[p][q] == 0) continue;
+                // The rotation that zeroes a[p][q], taking the smaller angle
+                double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1);
+                double s = t * c;
+                for (int k = 0; k < n; k++) {
+                    double kp = a[k][p], kq = a[k][q];
+                    a[k][p] = c * kp - s * kq;
+                    a[k][q] = s * kp + c * kq;
+                }
+                for (int k = 0; k < n; k++) {
+                    double pk = a[p][k], qk = a[q][k];
+                    a[p][k] = c * pk - s * qk;
+                    a[q][k] = s * pk + c * qk;
+                }
+                for (int k = 0; k < n; k++) {
+                    double kp = vectors[k][p], kq = vectors[k][q];
+                    vectors[k][p] = c * kp - s * kq;
+                    vectors[k][q] = s * kp + c * kq;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        values[i] = a[i][i];
+    }
+}
+
+void run_heur_tuning(const char *path, int generations, int games, uint64_t seed, int jobs) {
+    // CMA-ES over the heuristic weights, scoring each candidate by the mean score of the same seeded games.
+    // Every candidate playing the same spawns takes most of the luck out of comparing them. The search flags apply
+    // to the games as usual, so e.g. --depth 2 tunes much faster. The state is saved after every generation, and
+    // running again with the same checkpoint carries on from it.
+    const int n = HEUR_WEIGHT_COUNT;
+    if (stats_format == STATS_TEXT) stats_format = STATS_OFF;
+
+    // Recombination weights and learning rates, as set out in the tutorial
+    double recombination[TUNE_PARENTS];
+    double recombination_sum = 0;
+    for (int i = 0; i < TUNE_PARENTS; i++) {
+        recombination[i] = log(TUNE_PARENTS + 0.5) - log(i + 1.0);
+        recombination_sum += recombination[i];
+    }
+    double mu_eff = 0;
+    for (int i = 0; i < TUNE_PARENTS; i++) {
+        recombination[i] /= recombination_sum;
+        mu_eff += recombination[i] * recombination[i];
+    }
+    mu_eff = 1 / mu_eff;
+    double c_c = (4 + mu_eff / n) / (n + 4 + 2 * mu_eff / n);
+    double c_sigma = (mu_eff + 2) / (n + mu_eff + 5);
+    double c_1 = 2 / ((n + 1.3) * (n + 1.3) + mu_eff);
+    double c_mu = std::min(1 - c_1, 2 * (mu_eff - 2 + 1 / mu_eff) / ((n + 2) * (n + 2) + mu_eff));
+    double damping = 1 + 2 * std::max(0.0, sqrt((mu_eff - 1) / (n + 1)) - 1) + c_sigma;
+    double expected_norm = sqrt(n) * (1 - 1.0 / (4 * n) + 1.0 / (21 * n * n));
+
+    tune_state_t state;
+    if (state.read(path)) {
+        printf("Continuing tuning from %s at generation %d\n", path, state.generation);
+    } else {
+        state.init();
+    }
+    while (state.generation < generations) {
+        // Sample around the mean with the covariance C = B D^2 B^T
+        double basis[n][n];
+        double scale[n];
+        symmetric_eigen(state.cov, basis, scale);
+        for (int i = 0; i < n; i++) {
+            scale[i] = sqrt(std::max(scale[i], 0.0));
+        }
+        // Seeded by generation, so a resumed search samples what the interrupted one would have
+        rng_t rng(seed + state.generation);
+        double candidates[TUNE_POPULATION][n];
+        double scores[TUNE_POPULATION];
+        int order[TUNE_POPULATION];
+        for (int k = 0; k < TUNE_POPULATION; k++) {
+            double normal[n];
+            for (int i = 0; i < n; i++) {
+                // Box-Muller, with u1 in (0, 1]
+                double u1 = ((rng.next() >> 11) + 1) * 0x1.0p-53;
+                double u2 = (rng.next() >> 11) * 0x1.0p-53;
+                normal[i] = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+            }
+            for (int i = 0; i < n; i++) {
+                double step = 0;
+                for (int j = 0; j < n; j++) step += basis[i][j] * scale[j] * normal[j];
+                candidates[k][i] = state.mean[i] + state.sigma * step;
+            }
+
+            set_heur_weights(tune_weights(candidates[k]));
+            std::vector<game_stats_t> results = play_headless_games<default_ops_t>(games, seed, jobs);
+            scores[k] = 0;
+            for (game_stats_t &game : results) scores[k] += (double)game.score / games;
+            order[k] = k;
+            if (scores[k] > state.best_score) {
+                state.best_score = scores[k];
+                memcpy(state.best, candidates[k], sizeof(state.best));
+            }
+        }
+        std::sort(order, order + TUNE_POPULATION, [&](int a, int b) { return scores[a] > scores[b]; });
+
+        // Move the mean to the weighted average of the best candidates
+        double old_mean[n];
+        double mean_step[n]; // the move of the mean, in units of sigma
+        memcpy(old_mean, state.mean, sizeof(old_mean));
+        for (int i = 0; i < n; i++) {
+            state.mean[i] = 0;
+            for (int p = 0; p < TUNE_PARENTS; p++) state.mean[i] += recombination[p] * candidates[order[p]][i];
+            mean_step[i] = (state.mean[i] - old_mean[i]) / state.sigma;
+        }
+
+        // Step size path, which follows the mean's moves with the covariance taken out (C^-1/2 = B D^-1 B^T)
+        double whitened[n];
+        double path_sigma_norm = 0;
+        for (int j = 0; j < n; j++) {
+            whitened[j] = 0;
+            for (int i = 0; i < n; i++) whitened[j] += basis[i][j] * mean_step[i];
+            whitened[j] /= std::max(scale[j], 1e-300);
+        }
+        for (int i = 0; i < n; i++) {
+            double step = 0;
+            for (int j = 0; j < n; j++) step += basis[i][j] * whitened[j];
+            state.path_sigma[i] = (1 - c_sigma) * state.path_sigma[i] + sqrt(c_sigma * (2 - c_sigma) * mu_eff) * step;
+            path_sigma_norm += state.path_sigma[i] * state.path_sigma[i];
+        }
+        path_sigma_norm = sqrt(path_sigma_norm);
+        // Stall the covariance path while the step size path is long, so a growing sigma doesn't inflate C too
+        bool stalled = path_sigma_norm / sqrt(1 - pow(1 - c_sigma, 2.0 * (state.generation + 1))) / expected_norm >=
+                       1.4 + 2.0 / (n + 1);
+        for (int i = 0; i < n; i++) {
+            state.path_c[i] = (1 - c_c) * state.path_c[i] + (stalled ? 0 : sqrt(c_c * (2 - c_c) * mu_eff) * mean_step[i]);
+        }
+
+        // Rank one update from the covariance path plus rank mu update from this generation's best steps
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                double rank_mu = 0;
+                for (int p = 0; p < TUNE_PARENTS; p++) {
+                    const double *x = candidates[order[p]];
+                    rank_mu += recombination[p] * (x[i] - old_mean[i]) * (x[j] - old_mean[j]);
+                }
+                state.cov[i][j] = (1 - c_1 - c_mu) * state.cov[i][j] +
+                        c_1 * (state.path_c[i] * state.path_c[j] + (stalled ? c_c * (2 - c_c) * state.cov[i][j] : 0)) +
+                        c_mu * rank_mu / (state.sigma * state.sigma);
+            }
+        }
+        state.sigma *= exp((c_sigma / damping) * (path_sigma_norm / expected_norm - 1));
+        state.generation++;
+
+        printf("generation %d: best %.0f, worst %.0f, sigma %.4f, best so far %.0f\n", state.generation,
+               scores[order[0]], scores[order[TUNE_POPULATION - 1]], state.sigma, state.best_score);
+        fflush(stdout);
+        if (!state.write(path)) fprintf(stderr, "Couldn't write %s\n", path);
+    }
+
+    if (state.best_score < 0) return;
+    heur_weights_t best = tune_weights(state.best);
+    printf("best mean score %.0f over %d games, with weights\n    --heur-weights ", state.best_score, games);
+    for (int i = 0; i < n; i++) {
+        printf("%.9g%s", best.*heur_weight_fields[i], i + 1 < n ? "," : "\n");
+    }
+    printf("or compiled in with\n    g++ -std=c++17 -O2");
+    for (int i = 0; i < n; i++) {
+        printf(" -D%s=%.9gf", heur_weight_names[i], best.*heur_weight_fields[i]);
+    }
+    printf(" tableGen.cpp -o tableGen && ./tableGen > gameTables.h\n");
+}
+
 void print_bitboard(board_t board) {
     int board_nums[BOARD_SIZE];
     int square;
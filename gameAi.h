@@ -1,38 +1,338 @@
 #include <stdlib.h>
 #include <algorithm> // used for stable sort, max function
-#include <unordered_map> // for caching
 #include <cmath>
 #include <time.h> // used for setting rand seed
 #include <sys/time.h> // TEMPORARY
 #include <unistd.h> // grants sleep function used for testing
+#include <sys/mman.h> // mapped n-tuple weights
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <iostream> // reading in the board from .py
-#include <unordered_map>
+#include <string.h> // strcmp for command line flags
+#include <thread> // parallel root search
+#include <mutex>
+#include <atomic>
+#include <vector> // transposition table storage
+#include <chrono> // deadlines for budgeted searches
+#include <deque> // work-stealing task queues
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <type_traits> // board integer types of the other geometries
+#include <string>
+#include <sys/socket.h> // the multi-session server's Unix socket
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#if defined(__AVX2__)
+#include <immintrin.h> // batched leaf scoring
+#endif
 
 // Board state representations
 typedef uint64_t board_t;
 typedef uint16_t row_t;
 
-// Definitions for the caching table used during the expectimax search.
-struct cache_entry_t{
-    uint8_t depth;
-    float heuristic;
+// Definitions for the transposition table used during the expectimax search.
+// The table is a fixed, preallocated array of cache line sized buckets. A board hashes to a single bucket and
+// may live in any of its ways, so a lookup touches exactly one cache line and nothing is allocated while searching.
+#define TT_BUCKET_WAYS 3
+#define TT_DEFAULT_BITS 18 // 2^18 buckets * 64 bytes = 16MB
+#define TT_LOCK_STRIPES 1024 // buckets share a lock with every other bucket in the same stripe
+#define TT_EMPTY 0xFF // depth marker for an unused way
+
+// Outcomes of trans_table_t::store
+#define TT_STORE_SKIPPED 0 // every way holds a deeper entry from the current search
+#define TT_STORE_NEW 1 // written to an empty way
+#define TT_STORE_UPDATED 2 // overwrote an entry for the same board
+#define TT_STORE_REPLACED 3 // evicted a different board
+
+// Boards wider than 64 bits (see board_ops_t) fold their high half into the key the table hashes
+static inline uint64_t board_hash_key(uint64_t board) {
+    return board;
+}
+static inline uint64_t board_hash_key(unsigned __int128 board) {
+    return (uint64_t)board ^ ((uint64_t)(board >> 64) * 0xC2B2AE3D27D4EB4FULL);
+}
+
+// Set bits of a board of either width
+static inline int board_popcount(uint64_t board) {
+    return __builtin_popcountll(board);
+}
+static inline int board_popcount(unsigned __int128 board) {
+    return __builtin_popcountll((uint64_t)board) + __builtin_popcountll((uint64_t)(board >> 64));
+}
+
+// Entries are stored column-wise so that all three keys are compared from the start of the line.
+// With boards wider than 64 bits a bucket takes two lines.
+template <typename BOARD> struct alignas(64) basic_tt_bucket_t {
+    BOARD keys[TT_BUCKET_WAYS];
+    float scores[TT_BUCKET_WAYS];
+    float cprobs[TT_BUCKET_WAYS]; // probability the node was reached with, for exact lookups
+    uint8_t depths[TT_BUCKET_WAYS]; // remaining search depth below the node, TT_EMPTY if unused
+    uint8_t reached[TT_BUCKET_WAYS]; // plies the search reached below the node, fewer than depths where the cutoff stopped it
+    uint8_t ages[TT_BUCKET_WAYS]; // search generation the entry was written in
 };
 
-typedef std::unordered_map<board_t, cache_entry_t> cache_table_t;
+template <typename BOARD> struct basic_trans_table_t {
+    std::vector<basic_tt_bucket_t<BOARD>> buckets;
+    int shift; // 64 - log2(bucket count), the index is taken from the top bits of the hash
+    uint8_t generation; // bumped by new_search(), entries from older generations are replaced first
+    bool locking; // take the stripe locks, only needed when several threads share the table
+    bool scratch; // entries from older generations count as empty for probes and stores, as if the table was cleared by new_search()
+    std::atomic<size_t> filled; // number of ways in use
+    std::mutex locks[TT_LOCK_STRIPES];
 
-// The state of the current expectimax board evaluation
-struct eval_state {
-    cache_table_t cache_table; // cache map for previously-seen moves
-    int maxdepth;
+    basic_trans_table_t() : shift(64), generation(0), locking(false), scratch(false), filled(0) {
+    }
+
+    void resize(int bits);
+    void clear();
+    void new_search();
+    bool probe(BOARD board, int depth, float cprob, bool exact, bool current_only, float &score, int &reached);
+    int store(BOARD board, int depth, float cprob, float score, int reached);
+    size_t capacity() const { return buckets.size() * TT_BUCKET_WAYS; }
+    size_t index_for(BOARD board) const {
+        // Mix the high bits down so boards differing only in their top rows still spread across buckets
+        uint64_t key = board_hash_key(board);
+        key ^= key >> 29;
+        key *= 0x9E3779B97F4A7C15ULL;
+        return key >> shift;
+    }
+};
+
+typedef basic_tt_bucket_t<board_t> tt_bucket_t;
+typedef basic_trans_table_t<board_t> trans_table_t;
+
+// A root move's own entries while the root moves are searched. The move is searched against the shared table as it stood
+// before the search, which no thread writes to, and its own stores go here. Once every root move is done the entries
+// are stored into the shared table in direction order, so the table ends up the same whatever the thread timing.
+template <typename BOARD> struct basic_tt_overlay_t {
+    basic_trans_table_t<BOARD> table; // a scratch table, probed before the shared one
+    std::vector<uint32_t> touched; // buckets written since begin(), in the order first written, at most one per bucket
+
+    void begin(int bits);
+    int store(BOARD board, int depth, float cprob, float score, int reached);
+    void merge_into(basic_trans_table_t<BOARD> &shared) const;
+};
+
+typedef basic_tt_overlay_t<board_t> tt_overlay_t;
+#define TT_OVERLAY_BITS_LESS 2 // an overlay holds one root move's entries, so it has a quarter of the buckets
+
+// Limits for a budgeted, iteratively deepened search, shared by every thread searching the move
+#define ID_MAX_DEPTH 24 // deepest iteration attempted, even with budget to spare
+#define BUDGET_CHECK_INTERVAL 4096 // nodes searched between checks of the clock and node count
+
+// Boards the engine once misplayed, each searched by --regress with every kind of budget
+static const board_t regression_boards[] = {
+    1311768467750121216ULL, // every legal move scores 0 at depth 1, budgeted searches resigned rather than deepening
+};
+// Nearly empty boards, where the probability cutoff stops every branch a few plies down. A budgeted search must stop
+// deepening there rather than search the same tree again at every depth up to ID_MAX_DEPTH.
+static const board_t shallow_regression_boards[] = {
+    4096ULL, // a single two, which used up a 20ms budget and reported depth 24
+};
+#define REGRESSION_TIME_MS 50.0
+#define REGRESSION_NODES 1000000
+#define REGRESSION_TARGET_NODES 100000
+
+struct search_budget_t {
+    bool timed;
+    bool pondering; // speculative search for a board that may never arrive, not logged
+    std::chrono::steady_clock::time_point deadline;
+    unsigned long node_limit; // 0 for no node limit
+    std::atomic<unsigned long> nodes; // nodes searched by all threads, updated at each check
+    std::atomic<bool> stopped; // set once either limit is hit, stopping every thread
+
+    search_budget_t() : timed(false), pondering(false), node_limit(0), nodes(0), stopped(false) {
+    }
+};
+
+// Work-stealing pool used to search inside the expectimax tree.
+// Every pool thread owns a deque of tasks, pushing and popping its own tasks at the back while idle threads steal
+// from the front of the others', taking the oldest (and so largest) subtrees first. Threads outside the pool share
+// one extra deque. A thread waiting on its tasks runs queued tasks until they are done rather than blocking.
+struct task_group_t {
+    std::atomic<int> pending; // tasks spawned in the group that have not finished yet
+
+    task_group_t() : pending(0) {
+    }
+};
+
+struct search_task_t {
+    std::function<void()> run;
+    task_group_t *group;
+};
+
+struct task_queue_t {
+    std::mutex lock;
+    std::deque<search_task_t> tasks;
+};
+
+struct task_pool_t {
+    std::vector<std::thread> workers;
+    std::unique_ptr<task_queue_t[]> queues; // one per worker, then the one shared by threads outside the pool
+    int queue_count;
+    std::atomic<int> queued; // tasks waiting in any queue
+    std::atomic<int> sleepers; // workers waiting for tasks to be queued
+    std::atomic<bool> stopping;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+
+    task_pool_t() : queue_count(0), queued(0), sleepers(0), stopping(false) {
+    }
+    ~task_pool_t() { stop(); }
+
+    void start(int threads);
+    void stop();
+    bool running() const { return !workers.empty(); }
+    void spawn(task_group_t &group, std::function<void()> run);
+    void wait(task_group_t &group);
+    bool run_one(int self);
+    void worker_loop(int self);
+    int own_queue() const;
+};
+
+// Search statistics, reported per root move by --stats. Building with -DSEARCH_STATS=0 compiles all of these
+// counters out of the search, leaving only the node and cache hit counts it always kept.
+#ifndef SEARCH_STATS
+#define SEARCH_STATS 1
+#endif
+#if SEARCH_STATS
+#define SEARCH_STAT(x) x
+#else
+#define SEARCH_STAT(x)
+#endif
+#define STATS_MAX_PLY ID_MAX_DEPTH // deepest ply counted, the chance node after the root move being ply 0
+
+// Formats for the per root move statistics written to stderr
+#define STATS_OFF 0
+#define STATS_TEXT 1 // the original human readable line
+#define STATS_JSON 2
+#define STATS_CSV 3
+
+struct node_counters_t {
+    unsigned long max_nodes;
+    unsigned long chance_nodes; // chance nodes above the leaves, including those answered by the cache
+    unsigned long leaves; // chance nodes scored by the heuristic
+    unsigned long pruned; // leaves cut off by CPROB_THRESHOLD before reaching the depth limit
+    unsigned long cache_stores;
+    unsigned long cache_replaces; // stores that evicted a different board
+    unsigned long ply_nodes[STATS_MAX_PLY + 1]; // max and chance nodes at each ply
+
+    node_counters_t() : max_nodes(0), chance_nodes(0), leaves(0), pruned(0), cache_stores(0), cache_replaces(0),
+                        ply_nodes{} {
+    }
+
+    void add(const node_counters_t &other);
+};
+
+// The state of the current expectimax board evaluation, on the board geometry of OPS (see board_ops_t)
+template <typename OPS> struct basic_eval_state {
+    basic_trans_table_t<typename OPS::board_type> *table; // transposition table for previously-seen chance nodes
+    basic_tt_overlay_t<typename OPS::board_type> *overlay; // the root move's own entries, probed and stored first
+    bool exact_cache; // only reuse entries that match both the remaining depth and the probability exactly
+    bool canonical; // search each chance node in the canonical orientation of its 8 symmetries
+    bool current_only; // ignore entries written before the last new_search()
+    int maxdepth; // deepest ply searched, the leaves below a cached node counting as searched again
     int curdepth;
-    int cachehits;
+    unsigned long cachehits;
+    unsigned long cacheprobes;
     unsigned long moves_evaled;
+    node_counters_t counters; // only counted with SEARCH_STATS
     int depth_limit;
+    float cprob_threshold; // chance nodes less likely than this are scored as leaves
+    search_budget_t *budget; // nullptr for an unlimited search
+    unsigned long next_budget_check; // moves_evaled value at which the budget is next checked
+    unsigned long budget_reported; // moves_evaled already added to the budget's node count
+    bool aborted; // the budget ran out, every node returns immediately and nothing more is cached
 
-    eval_state() : maxdepth(0), curdepth(0), cachehits(0), moves_evaled(0), depth_limit(0) {
+    basic_eval_state() : table(nullptr), overlay(nullptr), exact_cache(false), canonical(false), current_only(false),
+                         maxdepth(0), curdepth(0), cachehits(0), cacheprobes(0), moves_evaled(0), depth_limit(0),
+                         cprob_threshold(0), budget(nullptr), next_budget_check(0), budget_reported(0), aborted(false) {
     }
 };
 
+// Every move of a 16 bit row, interleaved so that a single lookup within a single cache line gives them all.
+// Looked up by a row of the board it gives the row moved left and right. Looked up by a row of the transposed board,
+// which is a column of the board, it gives that column moved up and down, already spread back out into a column.
+struct alignas(32) row_moves_t {
+    board_t up;
+    board_t down;
+    row_t left;
+    row_t right;
+};
+
+#define MOVE_BENCH_TRIALS 5 // timed runs of each side in --bench-moves
+#define SEARCH_BENCH_TRIALS 3 // timed runs of each side in --bench-search
+#define SEARCH_BENCH_SLICE 20000 // nodes searched between suspensions in the sliced run of --bench-search
+
+// N-tuple network. Each tuple is a set of squares, and every one of the 16^n ways of filling them has a learned weight.
+// A board is valued by adding up the weights of every tuple under all 8 rotations and reflections of the board, so
+// symmetric boards share weights. The value estimates the score still to come after an afterstate, the board left by
+// a move before a tile spawns, which is exactly what the search evaluates at its leaves.
+// Weights files are a fixed size header followed by the weights of each tuple in turn, in the host's float format.
+// The engine memory maps them read only, so any number of engine processes share one copy.
+#define NTUPLE_MAGIC 0x5055544E // "NTUP"
+#define NTUPLE_VERSION 1
+#define NTUPLE_MAX_TUPLES 16
+#define NTUPLE_MAX_CELLS 6
+#define NTUPLE_SYMMETRIES 8
+#define NTUPLE_HEADER_SIZE 256 // the weights start on a cache line boundary after the header
+#define NTUPLE_DEFAULT_WEIGHTS "ntuple.weights"
+#define NTUPLE_REPORT_INTERVAL 1000 // games between progress reports and checkpoints while training
+
+struct ntuple_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tuple_count;
+    uint32_t cell_counts[NTUPLE_MAX_TUPLES];
+    uint8_t cells[NTUPLE_MAX_TUPLES][NTUPLE_MAX_CELLS]; // square indices, 0 being the lowest 4 bits of the board
+};
+
+struct ntuple_network_t {
+    int tuple_count;
+    int cell_counts[NTUPLE_MAX_TUPLES];
+    uint8_t cells[NTUPLE_MAX_TUPLES][NTUPLE_MAX_CELLS];
+    uint8_t shifts[NTUPLE_MAX_TUPLES][NTUPLE_SYMMETRIES][NTUPLE_MAX_CELLS]; // bit offset of each cell under each symmetry
+    float *weights[NTUPLE_MAX_TUPLES]; // read only when mapped from a file
+    void *mapping; // the mapped weights file, nullptr when the weights are owned
+    size_t mapping_size;
+    std::vector<float> owned; // weights being trained
+
+    ntuple_network_t() : tuple_count(0), mapping(nullptr), mapping_size(0) {
+    }
+    ~ntuple_network_t();
+
+    void init(int tuples, const int *counts, const uint8_t (*tuple_cells)[NTUPLE_MAX_CELLS]);
+    bool map(const char *path);
+    bool read(const char *path);
+    bool write(const char *path) const;
+    float value(board_t board) const;
+    void update(board_t board, float delta);
+};
+
+// Leaf evaluators. score_board and score_boards dispatch at compile time to the evaluator named by EVALUATOR, so the
+// search pays nothing for the choice. Build with -DEVALUATOR=ntuple_evaluator_t to search with an n-tuple network.
+// Each evaluator provides:
+//     load(weights_path)                    called once at startup, false if the evaluator can't be used
+//     score(board)                          the value of one afterstate
+//     score_batch(boards, count, scores)    the same for many boards at once
+struct heuristic_evaluator_t {
+    static bool load(const char *weights_path);
+    static inline float score(board_t board);
+    static inline void score_batch(const board_t *boards, int count, float *scores);
+};
+
+struct ntuple_evaluator_t {
+    static bool load(const char *weights_path);
+    static inline float score(board_t board);
+    static inline void score_batch(const board_t *boards, int count, float *scores);
+};
+
+#ifndef EVALUATOR
+#define EVALUATOR heuristic_evaluator_t
+#endif
+
 // Intuition behind the various constant values used
 #define ROW_SIZE 4
 #define BOARD_SIZE ROW_SIZE*ROW_SIZE
@@ -44,6 +344,7 @@ struct eval_state {
 // Note in the following, 'table' is different to 'board'. Table stores data on possible row states
 #define TABLE_SIZE 65536 // 2^16, 2 possible bit states, 16 bits, per row
 #define MAXIMUM_TILE 32768
+#define MAXIMUM_RANK 15 // MAXIMUM_TILE as the power of 2 stored in a square
 
 // This can be &'d with any 16bit row to output the number that represents the rightmost square (last 4 digits)
 #define SQUARE_MASK 0xF
@@ -57,32 +358,756 @@ struct eval_state {
 #define BOARD_SEPERATOR "================================"
 #define ROW_SEPERATOR   "--------------------------------"
 
+// The outcome of a full root search, as reported back to the frontend in server mode
+struct move_result_t {
+    int move; // -1 if no move is available
+    float scores[MOVE_DIRECTIONS]; // score of each root move, 0 if the move is illegal
+    unsigned long moves_evaled; // total nodes searched across all root moves
+    unsigned long cachehits;
+    unsigned long cacheprobes;
+    int depth; // depth limit of the search the move was taken from
+
+    move_result_t() : move(-1), scores{0.0f, 0.0f, 0.0f, 0.0f}, moves_evaled(0), cachehits(0), cacheprobes(0), depth(0) {
+    }
+};
+
+// Batch analysis of a file of boards, handed out to the threads in chunks and written out in input order
+#define ANALYSIS_CHUNK 64 // boards per chunk
+#define ANALYSIS_WINDOW 4 // chunks each thread may run ahead of the oldest unwritten one
+#define ANALYSIS_REPORT_INTERVAL 10000 // boards between progress reports
+#define ANALYSIS_CSV_HEADER "board,move,score_up,score_down,score_left,score_right,depth\n"
+
+// One analysed board in the binary output. Like the boards file, it is in the machine's byte order, little-endian on x86.
+struct analysis_record_t {
+    board_t board;
+    float scores[MOVE_DIRECTIONS]; // score of each move, 0 if the move is illegal
+    int32_t move; // -1 if no move is available
+    int32_t depth;
+};
+
+// Game traces: a header followed by one fixed size record per move, written as the game is played.
+// Like the other binary files, they are in the machine's byte order, little-endian on x86.
+#define TRACE_MAGIC 0x43525432 // "2TRC"
+#define TRACE_VERSION 1
+#define TRACE_NO_SPAWN 0xff // spawn_position of a record with no spawn after it, e.g. the last move of a trace
+#define TRACE_REPORT_LIMIT 10 // divergences listed in full by --replay
+
+struct trace_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seed; // seed of the spawns, 0 when the front end spawned them
+    uint32_t record_size; // sizeof(trace_record_t), so a reader can check the layout
+    uint32_t reserved[3];
+};
+
+struct trace_record_t {
+    board_t board; // board the move was chosen for
+    float scores[MOVE_DIRECTIONS]; // score of each root move
+    float move_ms; // time taken to choose the move
+    int8_t move; // -1 if no move is available, the end of the game
+    uint8_t depth;
+    uint8_t spawn_position; // square index of the tile spawned after the move, 0 being the lowest 4 bits
+    uint8_t spawn_rank; // 1 for a 2, 2 for a 4
+};
+
+// Writes each record once the next board arrives, which is when the tile spawned after the move is known
+struct trace_writer_t {
+    FILE *file;
+    bool pending;
+    trace_record_t record;
+    board_t afterstate; // the board after the pending record's move, before the spawn
+
+    trace_writer_t() : file(nullptr), pending(false) {
+    }
+    ~trace_writer_t() {
+        close();
+    }
+    bool open(const char *path, uint64_t seed);
+    void add(board_t board, const move_result_t &result, double move_ms);
+    void close();
+};
+
+// Position database: deep searches of the hardest boards met in self-play, built offline by --build-position-db and
+// consulted by select_move before it searches. A header, then an index of where the records for each value of the top
+// POSITION_DB_INDEX_BITS bits of a board start, then the records sorted by board. Boards are stored in their
+// canonical_board form, so one record answers for all 8 symmetries of a board.
+#define POSITION_DB_MAGIC 0x42445032 // "2PDB"
+#define POSITION_DB_VERSION 1
+#define POSITION_DB_INDEX_BITS 12
+#define POSITION_DB_INDEX_SIZE ((1 << POSITION_DB_INDEX_BITS) + 1) // one past the last bucket, for its end
+#define POSITION_DB_DEFAULT_POSITIONS 1000 // slowest trace positions searched by a build
+#define POSITION_DB_EXTRA_DEPTH 1 // added to the usual depth of a board when it is searched for the database
+
+struct position_db_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count; // number of records
+    uint32_t record_size; // sizeof(position_record_t), so a reader can check the layout
+    uint32_t index_bits;
+    uint32_t reserved[2];
+};
+
+struct position_record_t {
+    board_t board; // canonical_board of the searched board
+    float scores[MOVE_DIRECTIONS]; // score of each move on the canonical board
+    int8_t move;
+    uint8_t depth; // depth limit the board was searched to
+    uint8_t reserved[6];
+};
+
+// A read-only mapping of a database file
+struct position_db_t {
+    void *mapping;
+    size_t size;
+    const position_db_header_t *header;
+    const uint64_t *index; // POSITION_DB_INDEX_SIZE offsets into records
+    const position_record_t *records;
+    mutable std::atomic<unsigned long> hits; // lookups answered from the database
+
+    position_db_t() : mapping(nullptr), size(0), header(nullptr), index(nullptr), records(nullptr), hits(0) {
+    }
+    ~position_db_t() {
+        unmap();
+    }
+    bool map(const char *path);
+    void unmap();
+    const position_record_t *find(board_t canonical) const;
+    bool lookup(board_t board, int depth, move_result_t &result) const;
+};
+
+// The depth limit and probability cutoff of one move's search
+struct search_plan_t {
+    int depth_limit;
+    float cprob_threshold; // chance nodes less likely than this are scored as leaves
+    double predicted_nodes; // the policy's estimate of the nodes the search takes, 0 if it makes none
+
+    search_plan_t(int depth_limit, float cprob_threshold) : depth_limit(depth_limit), cprob_threshold(cprob_threshold),
+                                                             predicted_nodes(0) {
+    }
+};
+
+// What the depth policies see of a board, the same on every board geometry
+struct board_features_t {
+    int empties;
+    int distinct_tiles;
+};
+
+// Depth policies plan the search of each move before it starts, and are told how many nodes it took afterwards.
+// select_move plans with the policy depth_policy points at.
+struct depth_policy_t {
+    virtual ~depth_policy_t() {
+    }
+    virtual search_plan_t plan(const board_features_t &board) = 0;
+    virtual void observe(const board_features_t & /* board */, const search_plan_t & /* plan */, unsigned long /* nodes */) {
+    }
+};
+
+// The original rule: deeper as the board has more distinct tiles (or always --depth), with a fixed cutoff
+struct static_depth_policy_t : depth_policy_t {
+    search_plan_t plan(const board_features_t &board) override;
+};
+
+// Aims every search at --target-nodes nodes. The searches it can choose from form a ladder, from the shallowest and
+// coarsest up: each depth limit with each cutoff in adaptive_cutoffs, coarsest to finest, then the next depth.
+// It keeps a running estimate of the nodes each step takes by the number of empty squares, and plans the highest step
+// expected to fit in the target. It never goes more than one step past the steps measured so far, so a bad guess about
+// an untried step costs one slow move at most.
+#define ADAPTIVE_CUTOFFS 5
+#define ADAPTIVE_MAX_DEPTH 10
+#define ADAPTIVE_STEPS (ADAPTIVE_MAX_DEPTH * ADAPTIVE_CUTOFFS)
+#define ADAPTIVE_LEARNING_RATE 0.3 // weight of each new measurement in the running estimates
+// Log growth in nodes per depth assumed until measured, spread evenly over that depth's steps. It's the largest seen
+// between depths on a game's boards, so untried steps are thought expensive and are worked up to one at a time.
+#define ADAPTIVE_PRIOR_GROWTH 2.6
+#define ADAPTIVE_MAX_EMPTIES 25 // the most empty squares of any board geometry, those of the 5x5 board
+
+struct adaptive_depth_policy_t : depth_policy_t {
+    double target_nodes;
+    std::mutex mutex; // the benchmark and batch modes plan from many threads at once
+    double log_nodes[ADAPTIVE_MAX_EMPTIES + 1][ADAPTIVE_STEPS]; // running mean of the log of the nodes taken, by empty squares
+    bool measured[ADAPTIVE_MAX_EMPTIES + 1][ADAPTIVE_STEPS];
+
+    adaptive_depth_policy_t();
+    search_plan_t plan(const board_features_t &board) override;
+    void observe(const board_features_t &board, const search_plan_t &plan, unsigned long nodes) override;
+    void estimate(int empties, double *estimates);
+};
+
+// The iterative search keeps a frame for every node on the path from the root move's chance node down to the node
+// being searched, in place of the recursion's call stack. Chance and max nodes alternate down the path, so the chance
+// node at ply p is chance[p] and its max node children are max[p]. The frames sit in a fixed stack per thread, so the
+// search allocates nothing. As they hold everything still to be done below the root, the search can stop at any max
+// node and later carry on from exactly where it stopped.
+template <typename OPS> struct basic_chance_frame_t {
+    typename OPS::board_type board; // canonical if the search is
+    float cprob; // probability of reaching each child, before the 0.9 or 0.1 of its spawn
+    float node_cprob; // probability of reaching this node, as cached
+    int remaining; // depth left below this node, as cached
+    int outer_maxdepth; // state.maxdepth before the node, while it counts the plies reached below the node alone
+    int empties;
+    int children; // empty squares, each spawning a two child and a four child
+    int stage; // one of the CHANCE_STAGE_ values
+    int child; // next child searched in CHANCE_STAGE_CHILDREN, 2 * square + 1 for the four
+    bool two_frontier; // the two children were scored together by score_frontier_max_nodes
+    bool four_frontier;
+    typename OPS::board_type two_children[OPS::squares];
+    typename OPS::board_type four_children[OPS::squares];
+    float two_scores[OPS::squares];
+    float four_scores[OPS::squares];
+};
+
+#define CHANCE_STAGE_TWO_FRONTIER 0
+#define CHANCE_STAGE_FOUR_FRONTIER 1
+#define CHANCE_STAGE_CHILDREN 2
+
+template <typename OPS> struct basic_max_frame_t {
+    typename OPS::board_type board;
+    float cprob;
+    float score; // best child so far
+    int move; // next move searched
+    typename OPS::board_type successors[MOVE_DIRECTIONS];
+};
+
+template <typename OPS> struct basic_search_stack_t {
+    typedef typename OPS::board_type board_type;
+    typedef basic_eval_state<OPS> eval_state;
+
+    basic_chance_frame_t<OPS> chance[ID_MAX_DEPTH + 1];
+    basic_max_frame_t<OPS> max[ID_MAX_DEPTH + 1];
+    int top; // frames in use, 0 once the search has finished
+    float score; // the root's score once finished
+
+    bool start(eval_state &state, board_type board, float cprob);
+    bool run(eval_state &state);
+
+private:
+    bool enter_chance_node(eval_state &state, board_type board, float cprob, float &score);
+    bool run_chance_node(eval_state &state, basic_chance_frame_t<OPS> &frame);
+    bool run_max_node(eval_state &state, basic_max_frame_t<OPS> &frame);
+    void finish_node(float score);
+};
+
+// Counters gathered while searching a single root move
+struct search_stats_t {
+    unsigned long moves_evaled;
+    unsigned long cachehits;
+    unsigned long cacheprobes;
+    int maxdepth;
+
+    search_stats_t() : moves_evaled(0), cachehits(0), cacheprobes(0), maxdepth(0) {
+    }
+};
+
+// Multi-session server (--listen): many games at once over a Unix socket, in one process so the lookup tables are
+// shared, with the searches of every session run by one bounded pool of threads. Each session speaks the server mode
+// protocol, a board per line answered by a JSON line, plus the commands "target MS" and "metrics".
+#define SESSION_DEFAULT_TARGET_MS 100.0 // latency target of a new session, 0 searches to the usual depth
+#define SESSION_UNTIMED_SLACK_MS 1000.0 // deadline of a request from a session without a target, for ordering
+#define SESSION_MIN_BUDGET_MS 1.0 // least time a request that is already late is searched for
+#define SESSION_BATCH 8 // pipelined boards of one session answered for each scheduling decision
+#define SESSION_LATENCY_WINDOW 1024 // latest responses per session kept for the latency percentiles
+#define SESSION_LINE_LIMIT 256 // a longer request line closes the session
+#define SESSION_DEFAULT_TT_BITS 16 // 2^16 buckets * 64 bytes = 4MB per searched session
+
+struct session_request_t {
+    board_t board;
+    std::chrono::steady_clock::time_point arrival;
+};
+
+struct session_t {
+    int id;
+    int fd;
+    std::string input; // read but not yet a complete line
+    std::deque<session_request_t> pending; // waiting for a worker, oldest first
+    bool busy; // a worker is answering its requests, so no other worker may take them
+    bool closed; // the client hung up, freed by whoever holds it last
+    double target_ms; // latency target, including the time spent queued
+    trans_table_t table; // kept across the session's moves, as in server mode, allocated by its first search
+    std::mutex write_lock; // responses come from the workers, metrics from the I/O thread
+
+    // Metrics, guarded by the server's lock
+    unsigned long moves;
+    unsigned long missed; // responses later than the target
+    double served_ms; // worker time spent on the session
+    double waited_ms; // time its requests spent queued
+    std::vector<float> latencies; // ring of the last SESSION_LATENCY_WINDOW response times
+    size_t latency_next;
+
+    session_t(int id, int fd) : id(id), fd(fd), busy(false), closed(false), target_ms(SESSION_DEFAULT_TARGET_MS), moves(0),
+                                missed(0), served_ms(0), waited_ms(0), latency_next(0) {
+    }
+};
+
+struct session_server_t {
+    std::mutex lock;
+    std::condition_variable work; // a session has become ready, or the server is stopping
+    std::vector<std::unique_ptr<session_t>> sessions; // closed ones stay until no worker holds them
+    size_t queued; // requests waiting across all sessions
+    int workers;
+    int busy_workers;
+    int next_id;
+    bool stopping;
+
+    session_server_t() : queued(0), workers(0), busy_workers(0), next_id(1), stopping(false) {
+    }
+
+    void worker_loop();
+    session_t *next_session();
+    void handle_line(session_t *session, const char *line);
+    void remove_session(session_t *session);
+    std::string metrics();
+};
+
+// A speculative search of the boards that can follow the move just played, run in server mode while the frontend
+// spawns a tile and repaints. The engine only ever searches one board at a time: the ponder is stopped as soon as
+// the real board arrives, so the table needs no locking between the two.
+template <typename OPS> struct basic_ponder_t {
+    typedef typename OPS::board_type board_type;
+
+    std::thread worker;
+    basic_trans_table_t<board_type> *table; // the server's
+    search_budget_t budget; // only ever stopped, when the real board arrives
+    std::vector<board_type> successors; // most probable first
+    std::vector<move_result_t> results; // for successors[0, searched)
+    std::vector<search_plan_t> plans; // planned for every successor started
+    int searched;
+
+    basic_ponder_t(basic_trans_table_t<board_type> *table) : table(table), searched(0) {
+    }
+
+    void start(board_type board);
+    bool finish(board_type board, move_result_t &result);
+    void search();
+};
+
+// Small, fast and seedable random number generator (xorshift64*) for headless games.
+// Every game gets its own, so a game plays out the same whichever thread runs it.
+struct rng_t {
+    uint64_t state;
+
+    rng_t(uint64_t seed) {
+        // Scramble the seed (splitmix64) so that consecutive seeds start far apart
+        seed += 0x9E3779B97F4A7C15ULL;
+        seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+        state = (seed ^ (seed >> 31)) | 1;
+    }
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    // Uniform in [0, n)
+    unsigned below(unsigned n) {
+        return (unsigned)(((next() >> 32) * n) >> 32);
+    }
+};
+
+// The outcome of one headless benchmark game
+struct game_stats_t {
+    unsigned long score;
+    int max_rank; // power of 2 of the largest tile
+    int moves;
+    unsigned long moves_evaled;
+    unsigned long cachehits;
+    unsigned long cacheprobes;
+    std::vector<double> move_ms; // time taken to choose each move
+
+    game_stats_t() : score(0), max_rank(0), moves(0), moves_evaled(0), cachehits(0), cacheprobes(0) {
+    }
+};
+
+// Weights of the heuristic row features, in the order of the SCORE_ settings in tableGen.cpp. The defaults are
+// compiled into heur_score_table, and --heur-weights rebuilds the table in memory with others.
+struct heur_weights_t {
+    float lost_penalty;
+    float monotonicity_power;
+    float monotonicity_weight;
+    float sum_power;
+    float sum_weight;
+    float merges_weight;
+    float empty_weight;
+};
+#define HEUR_WEIGHT_COUNT 7
+
+// CMA-ES search over the heuristic weights (Hansen, The CMA Evolution Strategy: A Tutorial). Each weight is searched
+// as its log ratio to the compiled in weight, so the search starts at 0 and a step scales every weight alike.
+#define TUNE_POPULATION 9 // 4 + 3 ln(HEUR_WEIGHT_COUNT), the tutorial's default
+#define TUNE_PARENTS 4 // the best half of each generation moves the mean
+#define TUNE_INITIAL_SIGMA 0.3 // initial step in log weight space, about 35% either way
+#define TUNE_CHECKPOINT_VERSION 1
+
+// Everything needed to carry on a search, written out as text after every generation
+struct tune_state_t {
+    int generation;
+    double sigma;
+    double mean[HEUR_WEIGHT_COUNT];
+    double cov[HEUR_WEIGHT_COUNT][HEUR_WEIGHT_COUNT];
+    double path_c[HEUR_WEIGHT_COUNT]; // evolution path of the covariance
+    double path_sigma[HEUR_WEIGHT_COUNT]; // conjugate evolution path of the step size
+    double best[HEUR_WEIGHT_COUNT]; // best candidate evaluated so far, and its mean score
+    double best_score;
+
+    void init();
+    bool read(const char *path);
+    bool write(const char *path) const;
+};
+
+// Shared with tableGen.cpp, so the engine builds exactly the table that would be generated for the same weights.
+// Rows hold ROW_SQUARES squares of TILE_BITS bits each, so the other board geometries build theirs the same way.
+template <int ROW_SQUARES, int TILE_BITS>
+static inline void build_heur_rows(const heur_weights_t &weights, float *table) {
+    const int max_rank = (1 << TILE_BITS) - 1;
+    // Each power of each rank is only computed once rather than for every row
+    double sum_pows[max_rank + 1];
+    double monotonicity_pows[max_rank + 1];
+    for (int rank = 0; rank <= max_rank; rank++) {
+        sum_pows[rank] = pow(rank, weights.sum_power);
+        monotonicity_pows[rank] = pow(rank, weights.monotonicity_power);
+    }
+
+    for (unsigned row = 0; row < 1u << (ROW_SQUARES * TILE_BITS); row++) {
+        unsigned square[ROW_SQUARES];
+        for (int i = 0; i < ROW_SQUARES; i++) {
+            square[i] = (row >> (i * TILE_BITS)) & max_rank;
+        }
+
+        float sum = 0;
+        int empty = 0;
+        int merges = 0;
+
+        int prev = 0;
+        int counter = 0;
+        for (int i = 0; i < ROW_SQUARES; ++i) {
+            int rank = square[i];
+            sum += sum_pows[rank];
+            // Count the amount of empty squares
+            if (rank == 0) {
+                empty++;
+            } else {
+                // Test the amount of merges possible
+                if (prev == rank) {
+                    counter++;
+                } else if (counter > 0) {
+                    merges += 1 + counter;
+                    counter = 0;
+                }
+                prev = rank;
+            }
+        }
+        if (counter > 0) {
+            merges += 1 + counter;
+        }
+
+        // Weight the monotonicity in heur score
+        float monotonicity_left = 0;
+        float monotonicity_right = 0;
+        for (int i = 1; i < ROW_SQUARES; ++i) {
+            if (square[i-1] > square[i]) {
+                monotonicity_left += monotonicity_pows[square[i-1]] - monotonicity_pows[square[i]];
+            } else {
+                monotonicity_right += monotonicity_pows[square[i]] - monotonicity_pows[square[i-1]];
+            }
+        }
+
+        table[row] = weights.lost_penalty +
+            weights.empty_weight * empty +
+            weights.merges_weight * merges -
+            weights.monotonicity_weight * std::min(monotonicity_left, monotonicity_right) -
+            weights.sum_weight * sum;
+    }
+}
+
+static inline void build_heur_table(const heur_weights_t &weights, float *table) {
+    build_heur_rows<ROW_SIZE, SQUARE_BITS>(weights, table);
+}
+
+// Also shared with tableGen.cpp: the rows a left and a right move leave a row in, for any row length and square width
+template <int ROW_SQUARES, int TILE_BITS>
+static inline void shift_row(unsigned row, unsigned *left, unsigned *right) {
+    const unsigned max_rank = (1u << TILE_BITS) - 1;
+    unsigned square[ROW_SQUARES];
+    for (int i = 0; i < ROW_SQUARES; i++) {
+        square[i] = (row >> (i * TILE_BITS)) & max_rank;
+    }
+
+    // Merge any squares before compressing
+    for (int i = 0; i < ROW_SQUARES-1; i++) {
+        if (square[i] == 0) continue;
+        int j = i + 1;
+        while (j < ROW_SQUARES && square[j] == 0) {
+            j++;
+        }
+        if (j == ROW_SQUARES) break; // nothing left to merge with
+        if (square[j] == square[i]) {
+            if (square[j] == max_rank) continue; // handle the largest tile a square can hold
+            square[i]++;
+            square[j] = 0;
+        }
+    }
+    // Compress to the left, squares are now in order they would be in after a left shift.
+    // The comparison should return false if in order, and the only out of order case is an empty square after a tile.
+    std::stable_sort(square, square+ROW_SQUARES, [](unsigned a, unsigned b) { return a == 0 && b != 0; });
+    *left = 0;
+    for (int i = 0; i < ROW_SQUARES; i++) {
+        *left |= square[i] << (i * TILE_BITS);
+    }
+
+    // Reverse the order by compressing to the right, to emulate a right shift
+    std::stable_sort(square, square+ROW_SQUARES, [](unsigned a, unsigned b) { return a != 0 && b == 0; });
+    *right = 0;
+    for (int i = 0; i < ROW_SQUARES; i++) {
+        *right |= square[i] << (i * TILE_BITS);
+    }
+}
+
+// The engine's own functions, which tableGen.cpp neither uses nor defines
+#ifndef TABLE_GENERATOR
 // Lookup table functions
-bool left_shift_comp(const row_t a, const row_t b);
-bool right_shift_comp(const row_t a, const row_t b);
 static float score_board(board_t board);
 static float sum_row_scores(board_t board);
+static void score_boards(const board_t *boards, int count, float *scores);
+#if defined(__AVX2__)
+static inline __m256i transpose_boards_avx2(__m256i x);
+static inline void score_boards_avx2(const board_t *boards, float *scores);
+#endif
 
-void play_game();
+void play_game(const char *trace_path);
 board_t init_board();
-static inline board_t transpose_board(board_t board);
 board_t insert_rand_square(board_t board, board_t new_square);
+static board_t insert_square_at(board_t board, board_t new_square, int index);
 board_t get_new_square();
 int count_empty_squares(board_t board);
 
 static inline board_t play_move(int move, board_t board);
 static inline board_t play_move_right(board_t board);
+static inline void play_all_moves(board_t board, board_t *successors);
+void run_move_benchmark(int boards, uint64_t seed);
+void run_search_benchmark(int boards, uint64_t seed);
+bool run_regression();
+static std::vector<board_t> random_game_boards(int boards, rng_t &rng);
+static double search_boards(trans_table_t &table, const std::vector<board_t> &boards, int slice, std::vector<float> &scores,
+                            unsigned long *nodes);
+static void search_root_boards(trans_table_t &table, const std::vector<board_t> &boards, std::vector<float> &scores,
+                               unsigned long *nodes);
+void run_ntuple_training(const char *path, int games, int tuple_size, float alpha, uint64_t seed);
+void run_heur_tuning(const char *path, int generations, int games, uint64_t seed, int jobs);
+static void set_heur_weights(const heur_weights_t &weights);
+static bool parse_heur_weights(const char *text, heur_weights_t &weights);
+static heur_weights_t tune_weights(const double *x);
+static void symmetric_eigen(const double (*matrix)[HEUR_WEIGHT_COUNT], double (*vectors)[HEUR_WEIGHT_COUNT], double *values);
 static inline board_t play_move_left(board_t board);
 static inline board_t play_move_up(board_t board);
 static inline board_t play_move_down(board_t board);
 
 void print_bitboard(board_t board);
 
-void instantiate_tables();
+template <typename OPS> static void run_server(basic_trans_table_t<typename OPS::board_type> &table);
+template <typename BOARD> static bool parse_board(const std::string &line, BOARD &board);
+static std::string board_string(board_t board);
+static std::string board_string(unsigned __int128 board);
+bool run_session_server(const char *path, int jobs);
+static bool write_line(session_t *session, const std::string &line);
+void run_benchmark(int games, uint64_t seed, int jobs);
+template <typename OPS> static std::vector<game_stats_t> play_headless_games(int games, uint64_t seed, int jobs);
+bool run_analysis(const char *boards_path, const char *out_path, bool csv, int jobs);
+static bool resume_analysis(const char *out_path, bool csv, const board_t *boards, size_t count, size_t &done);
+bool run_replay(const char *trace_path, const char *out_path, int jobs);
+static bool find_spawn(board_t afterstate, board_t board, int *position, int *rank);
+bool run_position_db_build(const char *out_path, const std::vector<const char *> &trace_paths, int positions, int jobs);
+static bool read_trace(const char *path, std::vector<trace_record_t> &records);
+static bool write_position_db(const char *path, const std::vector<position_record_t> &records);
+template <typename OPS>
+static game_stats_t play_headless_game(uint64_t seed, basic_trans_table_t<typename OPS::board_type> &table);
+template <typename OPS>
+static typename OPS::board_type spawn_square(typename OPS::board_type board, rng_t &rng, int *position, int *rank);
+static unsigned long score_game_board(board_t board);
+static int max_tile_rank(board_t board);
 float score_root_move(board_t board, int move);
-static float score_chance_node(eval_state &state, board_t board, float cprob);
-static float score_max_node(eval_state &state, board_t board, float cprob);
+template <typename OPS>
+static float score_root_move(basic_trans_table_t<typename OPS::board_type> &table, typename OPS::board_type board, int move,
+                             const search_plan_t &plan, search_budget_t *budget, search_stats_t *stats,
+                             basic_tt_overlay_t<typename OPS::board_type> *overlay);
+template <typename OPS>
+static basic_tt_overlay_t<typename OPS::board_type> *
+begin_root_overlays(const basic_trans_table_t<typename OPS::board_type> &table);
+template <typename OPS>
+static bool search_root_moves(basic_trans_table_t<typename OPS::board_type> &table, typename OPS::board_type board,
+                              const search_plan_t &plan, search_budget_t *budget, move_result_t &result, int *maxdepth);
+template <typename OPS>
+static int select_move_budgeted(typename OPS::board_type board, move_result_t &result,
+                                basic_trans_table_t<typename OPS::board_type> &table, double time_ms,
+                                unsigned long node_limit, const move_result_t *searched = nullptr);
+template <typename OPS> static inline bool budget_exhausted(basic_eval_state<OPS> &state);
+template <typename OPS>
+static inline bool probe_cache(basic_eval_state<OPS> &state, typename OPS::board_type board, int depth, float cprob, float &score);
+template <typename OPS>
+static inline int store_cache(basic_eval_state<OPS> &state, typename OPS::board_type board, int depth, float cprob, float score,
+                              int reached);
+template <typename OPS> static inline board_features_t board_features(typename OPS::board_type board);
+static inline int default_depth_limit(const board_features_t &board);
+template <typename OPS>
+static void log_search_plan(typename OPS::board_type board, const search_plan_t &plan, const move_result_t &result);
+template <typename OPS> static float score_chance_node(basic_eval_state<OPS> &state, typename OPS::board_type board, float cprob);
+template <typename OPS> static float score_max_node(basic_eval_state<OPS> &state, typename OPS::board_type board, float cprob);
+template <typename OPS>
+static float score_chance_node_iterative(basic_eval_state<OPS> &state, typename OPS::board_type board, float cprob);
+template <typename OPS>
+static void log_root_move(const basic_eval_state<OPS> &state, typename OPS::board_type board, int move, float score,
+                          double wall_ms, size_t filled, size_t capacity);
+static void print_stats_header();
+template <typename OPS>
+static void score_frontier_max_nodes(basic_eval_state<OPS> &state, const typename OPS::board_type *boards, int count,
+                                     float *scores);
+template <typename OPS>
+static void spawn_max_node(task_group_t &group, basic_eval_state<OPS> &state, basic_eval_state<OPS> &child,
+                           typename OPS::board_type board, float cprob, float *score);
+template <typename OPS> static void merge_search_counters(basic_eval_state<OPS> &state, const basic_eval_state<OPS> &child);
 int select_move(board_t board);
+int select_move(board_t board, move_result_t &result);
+int select_move(board_t board, move_result_t &result, trans_table_t &table);
+int select_move(board_t board, move_result_t &result, trans_table_t &table, double time_ms, unsigned long node_limit);
+template <typename OPS>
+static int select_move(typename OPS::board_type board, move_result_t &result, basic_trans_table_t<typename OPS::board_type> &table,
+                       double time_ms, unsigned long node_limit);
 static inline int count_distinct_tiles(board_t board);
+static inline board_t mirror_rows(board_t board);
+static inline board_t mirror_columns(board_t board);
+static inline board_t canonical_board(board_t board);
+static inline board_t apply_symmetry(board_t board, int symmetry);
+static inline int symmetric_move(int move, int symmetry);
 
 float score_baselevel_move(board_t board, int move);
+#endif
+
+// Shared with tableGen.cpp, which needs it to build the column tables
+static inline board_t transpose_board(board_t x) {
+    // The most involved algorithm in the program, see extras/transpose.png for a visual example
+    board_t a1 = x & 0xF0F00F0FF0F00F0FULL;
+    board_t a2 = x & 0x0000F0F00000F0F0ULL;
+    board_t a3 = x & 0x0F0F00000F0F0000ULL;
+    board_t a = a1 | (a2 << 12) | (a3 >> 12);
+    board_t b1 = a & 0xFF00FF0000FF00FFULL;
+    board_t b2 = a & 0x00FF00FF00000000ULL;
+    board_t b3 = a & 0x00000000FF00FF00ULL;
+    return b1 | (b2 >> 24) | (b3 << 24);
+}
+
+// Other board geometries. The engine is written around the 4x4 grid with 4 bit squares, where a board fits in board_t
+// and the move and score tables are compiled in. board_ops_t<GRID, TILE_BITS> is the same board on any square grid and
+// square width, and the search, the server and the benchmark games are templates over it. The board is held in the
+// narrowest integer that fits it, and the row tables are built at startup by the same code as tableGen.cpp.
+// board_ops_t<4, 4> is specialised to the engine's own board functions, so the usual geometry compiles to the code it
+// always has.
+#define VARIANT_ROW_BITS_LIMIT 20 // a row indexes tables of up to 2^20 entries
+
+// The narrowest unsigned integer holding BITS bits
+template <int BITS> struct uint_for_bits {
+    typedef typename std::conditional<BITS <= 16, uint16_t,
+            typename std::conditional<BITS <= 32, uint32_t,
+            typename std::conditional<BITS <= 64, uint64_t, unsigned __int128>::type>::type>::type type;
+};
+
+// SQUARE repeated in every one of the squares of a board, e.g. 1 gives the lowest bit of every square
+template <typename BOARD, int SQUARES, int TILE_BITS>
+constexpr BOARD repeat_square(BOARD square) {
+    BOARD board = 0;
+    for (int i = 0; i < SQUARES; i++) {
+        board |= square << (i * TILE_BITS);
+    }
+    return board;
+}
+
+template <int GRID, int TILE_BITS> struct board_ops_t {
+    static_assert(GRID * GRID * TILE_BITS <= 128, "a board must fit in 128 bits");
+    static_assert(GRID * TILE_BITS <= VARIANT_ROW_BITS_LIMIT, "the row tables would be too large");
+    typedef typename uint_for_bits<GRID * GRID * TILE_BITS>::type board_type;
+    typedef typename uint_for_bits<GRID * TILE_BITS>::type row_type;
+    static const int grid = GRID;
+    static const int squares = GRID * GRID;
+    static const int tile_bits = TILE_BITS;
+    static const int row_bits = GRID * TILE_BITS;
+    static const int max_rank = (1 << TILE_BITS) - 1; // the largest tile a square can hold, as a power of 2
+    static constexpr board_type square_lows = repeat_square<board_type, GRID * GRID, TILE_BITS>(1);
+
+    // Everything the board functions need of a row in one record, as row_moves_t is for the 4x4 board. Looked up by a
+    // row of the board it gives the row moved left and right, and by a row of the transpose (a column of the board) that
+    // column moved up and down, already spread back out into a column. It also holds the row reversed and spread out
+    // into a column, so the transpose and the symmetries are a lookup per row too.
+    struct row_record_t {
+        board_type up;
+        board_type down;
+        board_type column; // the row's squares down the first column, square 0 at the top
+        row_type left;
+        row_type right;
+        row_type reversed;
+    };
+
+    // Indexed by a row, built by init()
+    static std::vector<row_record_t> row_records;
+    static std::vector<float> heur_score_table;
+    static std::vector<float> score_table;
+
+    static void init(const heur_weights_t &weights);
+    static inline row_type get_row(board_type board, int row) {
+        return (row_type)((board >> (row * row_bits)) & ((board_type(1) << row_bits) - 1));
+    }
+    static inline int get_square(board_type board, int square) {
+        return (int)(board >> (square * TILE_BITS)) & max_rank;
+    }
+    static inline board_type transpose(board_type board);
+    static inline board_type mirror_rows(board_type board);
+    static inline board_type mirror_columns(board_type board);
+    static inline board_type canonical(board_type board);
+    static inline int count_empty_squares(board_type board);
+    static inline int count_distinct_tiles(board_type board);
+    static inline int max_tile_rank(board_type board);
+    static inline int spawn_children(board_type board, board_type *two_children, board_type *four_children);
+    static inline board_type insert_square_at(board_type board, int rank, int index);
+    static inline board_type play_move(int move, board_type board);
+    static inline void play_all_moves(board_type board, board_type *successors);
+    static inline float score_board(board_type board);
+    static inline void score_boards(const board_type *boards, int count, float *scores);
+    static unsigned long score_game_board(board_type board);
+};
+
+#ifndef TABLE_GENERATOR
+// The usual geometry, on the hand written board functions above and the tables compiled in from gameTables.h
+template <> struct board_ops_t<ROW_SIZE, SQUARE_BITS> {
+    typedef board_t board_type;
+    typedef row_t row_type;
+    static const int grid = ROW_SIZE;
+    static const int squares = BOARD_SIZE;
+    static const int tile_bits = SQUARE_BITS;
+    static const int row_bits = ROW_BITS;
+    static const int max_rank = MAXIMUM_RANK;
+
+    static void init(const heur_weights_t & /* weights */) {
+    }
+    static inline board_t transpose(board_t board) { return transpose_board(board); }
+    static inline board_t canonical(board_t board) { return canonical_board(board); }
+    static inline int count_empty_squares(board_t board) { return ::count_empty_squares(board); }
+    static inline int count_distinct_tiles(board_t board) { return ::count_distinct_tiles(board); }
+    static inline int max_tile_rank(board_t board) { return ::max_tile_rank(board); }
+    static inline int spawn_children(board_t board, board_t *two_children, board_t *four_children);
+    static inline board_t insert_square_at(board_t board, int rank, int index) { return ::insert_square_at(board, rank, index); }
+    static inline board_t play_move(int move, board_t board) { return ::play_move(move, board); }
+    static inline void play_all_moves(board_t board, board_t *successors) { ::play_all_moves(board, successors); }
+    static inline float score_board(board_t board) { return ::score_board(board); }
+    static inline void score_boards(const board_t *boards, int count, float *scores) { ::score_boards(boards, count, scores); }
+    static unsigned long score_game_board(board_t board) { return ::score_game_board(board); }
+};
+
+typedef board_ops_t<ROW_SIZE, SQUARE_BITS> default_ops_t;
+typedef basic_eval_state<default_ops_t> eval_state;
+typedef basic_search_stack_t<default_ops_t> search_stack_t;
+typedef basic_ponder_t<default_ops_t> ponder_t;
+
+static bool variant_supported(int grid, int tile_bits);
+static std::vector<game_stats_t> play_variant_games(int grid, int tile_bits, int games, uint64_t seed, int jobs);
+static void run_variant_server(int grid, int tile_bits);
+template <typename OPS> static void run_geometry_server();
+#endif
@@ -0,0 +1,144 @@
+// Generates gameTables.h, the move and scoring lookup tables used by the engine.
+//
+// Building the tables takes a fair amount of work (pow() and sorts over every possible row), so rather than doing it
+// on every start the engine compiles them in as const data. They then sit in read-only pages of the executable, which
+// costs nothing at startup and lets every running engine process share one physical copy.
+//
+// Regenerate the tables whenever this file or the heuristic weights change:
+//     g++ -std=c++17 -O2 tableGen.cpp -o tableGen && ./tableGen > gameTables.h
+#define TABLE_GENERATOR // only the board types and the table builders of gameAi.h
+#include "gameAi.h"
+
+// Heuristic scoring settings - values taken from existing nneonneo 2048 ai.
+// These can be overridden when regenerating the tables, e.g. g++ -DSCORE_SUM_WEIGHT=12.0f tableGen.cpp -o tableGen
+#ifndef SCORE_LOST_PENALTY
+#define SCORE_LOST_PENALTY 200000.0f
+#endif
+#ifndef SCORE_MONOTONICITY_POWER
+#define SCORE_MONOTONICITY_POWER 4.0f
+#endif
+#ifndef SCORE_MONOTONICITY_WEIGHT
+#define SCORE_MONOTONICITY_WEIGHT 47.0f
+#endif
+#ifndef SCORE_SUM_POWER
+#define SCORE_SUM_POWER 3.5f
+#endif
+#ifndef SCORE_SUM_WEIGHT
+#define SCORE_SUM_WEIGHT 11.0f
+#endif
+#ifndef SCORE_MERGES_WEIGHT
+#define SCORE_MERGES_WEIGHT 700.0f
+#endif
+#ifndef SCORE_EMPTY_WEIGHT
+#define SCORE_EMPTY_WEIGHT 270.0f
+#endif
+
+static row_t row_left_table [TABLE_SIZE];
+static row_t row_right_table[TABLE_SIZE];
+static board_t col_up_table[TABLE_SIZE];
+static board_t col_down_table[TABLE_SIZE];
+static float score_table[TABLE_SIZE];
+static float heur_score_table[TABLE_SIZE];
+static row_moves_t row_moves_table[TABLE_SIZE];
+static const heur_weights_t heur_table_weights = {SCORE_LOST_PENALTY, SCORE_MONOTONICITY_POWER, SCORE_MONOTONICITY_WEIGHT,
+                                                  SCORE_SUM_POWER, SCORE_SUM_WEIGHT, SCORE_MERGES_WEIGHT, SCORE_EMPTY_WEIGHT};
+
+void instantiate_tables();
+template <typename T> static void print_table(const char *type, const char *name, const char *comment, const T *table,
+                                              void (*print_entry)(const T &));
+
+int main() {
+    instantiate_tables();
+
+    printf("// Generated by tableGen.cpp, do not edit. Regenerate with:\n");
+    printf("//     g++ -std=c++17 -O2 tableGen.cpp -o tableGen && ./tableGen > gameTables.h\n");
+    printf("//\n");
+    printf("// Heuristic weights: SCORE_LOST_PENALTY=%g SCORE_MONOTONICITY_POWER=%g SCORE_MONOTONICITY_WEIGHT=%g\n",
+           SCORE_LOST_PENALTY, SCORE_MONOTONICITY_POWER, SCORE_MONOTONICITY_WEIGHT);
+    printf("//                    SCORE_SUM_POWER=%g SCORE_SUM_WEIGHT=%g SCORE_MERGES_WEIGHT=%g SCORE_EMPTY_WEIGHT=%g\n",
+           SCORE_SUM_POWER, SCORE_SUM_WEIGHT, SCORE_MERGES_WEIGHT, SCORE_EMPTY_WEIGHT);
+
+    // Floats are printed as hex literals so the compiled tables are bit for bit the ones computed here
+    print_table<row_t>("row_t", "row_left_table", nullptr, row_left_table, [](const row_t &x) { printf("0x%04x", x); });
+    print_table<row_t>("row_t", "row_right_table", nullptr, row_right_table, [](const row_t &x) { printf("0x%04x", x); });
+    print_table<board_t>("board_t", "col_up_table",
+        "Since columns are vertical, we need a board_t to store them. There will still only be 2^16 of them.",
+        col_up_table, [](const board_t &x) { printf("0x%llxULL", (unsigned long long)x); });
+    print_table<board_t>("board_t", "col_down_table", nullptr, col_down_table,
+        [](const board_t &x) { printf("0x%llxULL", (unsigned long long)x); });
+    print_table<row_moves_t>("row_moves_t", "row_moves_table",
+        "All four tables above interleaved into one record per row, for play_all_moves.",
+        row_moves_table, [](const row_moves_t &x) {
+            printf("{0x%llxULL, 0x%llxULL, 0x%04x, 0x%04x}", (unsigned long long)x.up, (unsigned long long)x.down, x.left, x.right);
+        });
+    print_table<float>("float", "score_table",
+        "Regular score table is kept for the sake of testing and comparison, heur table is primarily used however.",
+        score_table, [](const float &x) { printf("%af", x); });
+    print_table<float>("float", "heur_score_table", nullptr, heur_score_table, [](const float &x) { printf("%af", x); });
+
+    printf("\n// The weights heur_score_table was built with, where --tune starts its search\n");
+    printf("static const heur_weights_t heur_table_weights = {%af, %af, %af, %af, %af, %af, %af};\n",
+           heur_table_weights.lost_penalty, heur_table_weights.monotonicity_power, heur_table_weights.monotonicity_weight,
+           heur_table_weights.sum_power, heur_table_weights.sum_weight, heur_table_weights.merges_weight,
+           heur_table_weights.empty_weight);
+    return 0;
+}
+
+template <typename T>
+static void print_table(const char *type, const char *name, const char *comment, const T *table, void (*print_entry)(const T &)) {
+    printf("\n");
+    if (comment) printf("// %s\n", comment);
+    printf("static const %s %s[TABLE_SIZE] = {", type, name);
+    for (int row = 0; row < TABLE_SIZE; row++) {
+        // Eight entries per line keeps the file diffable
+        printf(row % 8 ? " " : "\n    ");
+        print_entry(table[row]);
+        printf(",");
+    }
+    printf("\n};\n");
+}
+
+void instantiate_tables() {
+    // The heuristic table is built by the same code the engine uses to rebuild it with other weights at runtime
+    build_heur_table(heur_table_weights, heur_score_table);
+
+    for (unsigned row = 0; row < TABLE_SIZE; row++) {
+        // Store each square
+        unsigned square[ROW_SIZE] = {
+            // Each of these squares is &'d with 0xf = 1111 such that only the last 4 bits are possibly positive.
+            // This technique is used often throughout the software to extract rows or squares.
+                (row) & 0xf,
+                (row >>  SQUARE_BITS) & 0xf,
+                (row >>  2*SQUARE_BITS) & 0xf,
+                (row >> 3*SQUARE_BITS) & 0xf,  
+        };
+
+        // Add this row to the score table
+        float score = 0.0f;
+        for (int i = 0; i < ROW_SIZE; ++i) {
+            int tile = square[i];
+            if (tile >= 2) {
+                // The score is the total sum of the tile and all intermediate merged tiles
+                // Noting we store the power of 2 (n) for each square, the formula is 2^(n+1) - 1
+                score += (tile - 1) * (1 << tile);
+            }
+        }
+        score_table[row] = score;
+
+        // Shift the row each way, with the same code the other board geometries build their tables with
+        unsigned left, right;
+        shift_row<ROW_SIZE, SQUARE_BITS>(row, &left, &right);
+        row_t left_shift_result = left;
+        row_t right_shift_result = right;
+
+        // Add this row iteration to the tables
+        row_left_table[row] = left_shift_result;
+        row_right_table[row] = right_shift_result;
+
+        // Note that while we store this at 'row' in the col tables, these tables will always be referenced after a transpose. 
+        // Hence they will actually be indexed by columns, just in the form of rows, returning the result in the form of a column.
+        col_up_table[row] = transpose_board(left_shift_result); 
+        col_down_table[row] = transpose_board(right_shift_result);
+        row_moves_table[row] = row_moves_t{col_up_table[row], col_down_table[row], left_shift_result, right_shift_result};
+    }
+}